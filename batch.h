@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "synth.h"
+#include "wav.h"
+
+// One render of a batch: seconds of sequencer playing patch, to a wav at
+// path. render_batch fills in how long it took and whether it was written.
+struct RenderJob {
+    std::string path;
+    double seconds = 0;
+    Patch patch;
+    Synth::Sequencer sequencer;
+    double ms = 0;
+    bool ok = false;
+};
+
+// Sets one option of a manifest line on job, false if it isn't one.
+inline bool job_option(RenderJob &job, const char *name, const char *value) {
+    // a shorter list repeats to fill the eight steps
+    auto list = [&](float *to) {
+        size_t count = 0;
+        for (auto p = value; count < 8 && *p; count++) {
+            char *end;
+            to[count] = strtof(p, &end);
+            p = *end == ',' ? end + 1 : end;
+        }
+        for (size_t i = count; count && i < 8; i++) {
+            to[i] = to[i % count];
+        }
+    };
+    auto &patch = job.patch;
+    if (!value) {
+        if (strcmp(name, "noise") == 0 || strcmp(name, "pink") == 0) {
+            patch.oscillator = Oscillator::Noise;
+            patch.noise = name[0] == 'p' ? NoiseColor::Pink : NoiseColor::White;
+        } else if (strcmp(name, "drums") == 0) {
+            patch.drums = DrumShape::groove();
+        } else if (strcmp(name, "no-limit") == 0) {
+            patch.dynamics.limiter.on = false;
+        } else {
+            return false;
+        }
+    } else if (strcmp(name, "bpm") == 0) {
+        job.sequencer.bpm = std::clamp(atoi(value), 1, 1000);
+    } else if (strcmp(name, "notes") == 0) {
+        list(job.sequencer.pattern);
+    } else if (strcmp(name, "velocity") == 0) {
+        list(job.sequencer.velocity);
+    } else if (strcmp(name, "filter") == 0) {
+        if (strcmp(value, "lowpass") == 0) {
+            patch.filter = FilterType::LowPass;
+        } else if (strcmp(value, "ladder") == 0) {
+            patch.filter = FilterType::Ladder;
+        } else if (strcmp(value, "svf") == 0) {
+            patch.filter = FilterType::StateVariable;
+        } else {
+            return false;
+        }
+    } else if (strcmp(name, "cutoff") == 0) {
+        patch.cutoff = strtof(value, nullptr);
+    } else if (strcmp(name, "resonance") == 0) {
+        patch.resonance = strtof(value, nullptr);
+    } else if (strcmp(name, "unison") == 0) {
+        patch.unison.count = strtoull(value, nullptr, 10);
+    } else if (strcmp(name, "drive") == 0) {
+        patch.drive.drive = strtof(value, nullptr);
+    } else if (strcmp(name, "echo") == 0) {
+        patch.effects.echo.mix = strtof(value, nullptr);
+    } else if (strcmp(name, "chorus") == 0) {
+        patch.effects.chorus = SweepShape::chorus(strtof(value, nullptr));
+    } else if (strcmp(name, "flanger") == 0) {
+        patch.effects.flanger = SweepShape::flanger(strtof(value, nullptr));
+    } else if (strcmp(name, "reverb") == 0) {
+        patch.effects.reverb.mix = strtof(value, nullptr);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A manifest is a job a line: the wav to write, its length in seconds and
+// then options, either switches (noise, pink, drums, no-limit) or
+// name=value (bpm, notes and velocity as up to eight comma separated values,
+// filter as lowpass, ladder or svf, cutoff, resonance, unison, drive, and
+// echo, chorus, flanger and reverb as their mix). Blank lines and lines
+// starting with # are skipped.
+//
+//     out/lead.wav 8 bpm=120 notes=440,0,660,0,550,0,440,0 reverb=0.3
+inline bool read_manifest(const char *path, std::vector<RenderJob> &jobs) {
+    auto file = fopen(path, "r");
+    if (!file) {
+        printf("couldn't open %s\n", path);
+        return false;
+    }
+    char line[4096];
+    auto ok = true;
+    for (size_t number = 1; ok && fgets(line, sizeof(line), file); number++) {
+        auto word = strtok(line, " \t\r\n");
+        if (!word || word[0] == '#') {
+            continue;
+        }
+        auto job = RenderJob();
+        job.path = word;
+        auto seconds = strtok(nullptr, " \t\r\n");
+        job.seconds = seconds ? strtod(seconds, nullptr) : 0;
+        if (!(job.seconds > 0)) {
+            printf("%s:%zu: no length in seconds\n", path, number);
+            ok = false;
+        }
+        while (ok && (word = strtok(nullptr, " \t\r\n"))) {
+            auto equals = strchr(word, '=');
+            if (equals) {
+                *equals = 0;
+            }
+            if (!job_option(job, word, equals ? equals + 1 : nullptr)) {
+                printf("%s:%zu: unknown option %s\n", path, number, word);
+                ok = false;
+            }
+        }
+        jobs.push_back(job);
+    }
+    fclose(file);
+    return ok;
+}
+
+// Renders a job with a Synth of its own, written out a block at a time. The
+// synth has no loop cache, which would cost every worker 10 MB.
+inline void render_job(RenderJob &job, Isa isa) {
+    auto begin = std::chrono::steady_clock::now();
+    auto synth = std::make_unique<Synth>();
+    synth->isa = isa;
+    synth->cache_loops = false;
+    synth->sequencer = job.sequencer;
+    synth->load(job.patch);
+    auto frames = static_cast<uint64_t>(job.seconds * samples_per_sec);
+    int16_t data[buffer_size * channels];
+    WavWriter writer;
+    if (writer.open(job.path.c_str(), channels, samples_per_sec)) {
+        for (uint64_t done = 0; writer.ok && done < frames; done += buffer_size) {
+            auto n = std::min<uint64_t>(frames - done, buffer_size);
+            synth->make_sound(data, n);
+            writer.write(data, n);
+        }
+        job.ok = writer.finish();
+    }
+    job.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Renders every job, each worker taking the next job not yet started, so
+// short and long jobs share the cores out between them. Every job gets a
+// fresh Synth, so what it renders doesn't depend on which worker took it
+// or what that worker rendered before.
+inline void render_batch(std::vector<RenderJob> &jobs, size_t threads, Isa isa = Isa::Default) {
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < std::clamp<size_t>(threads, 1, std::max<size_t>(jobs.size(), 1)); w++) {
+        workers.emplace_back([&]() {
+            FlushDenormals flush;
+            for (size_t job; (job = next++) < jobs.size(); ) {
+                render_job(jobs[job], isa);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,837 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#include "batch.h"
+#include "offline.h"
+#include "synth.h"
+
+template <typename F>
+double time_ms(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void report(const char *name, double ms, double audio_seconds) {
+    printf("%-40s %9.3f ms  %8.1fx realtime\n", name, ms, audio_seconds * 1000 / ms);
+}
+
+// A note followed by a long rest: the filter decays from full scale
+// towards zero and passes through the subnormal range on the way, unless
+// the voices go to sleep first.
+void bench_rest(bool flush, bool sleep) {
+    constexpr int seconds = 20;
+    constexpr size_t decay = samples_per_sec * 2;
+    Synth synth;
+    synth.cache_loops = false;
+    synth.sleep_voices = sleep;
+    synth.filter.cutoff = 15;
+    synth.filter.smoothed = 15;
+    std::fill(std::begin(synth.sequencer.pattern), std::end(synth.sequencer.pattern), 0.0f);
+    std::array<int16_t, buffer_size * channels> data;
+    auto ms = time_ms([&]() {
+        std::optional<FlushDenormals> guard;
+        if (flush) {
+            guard.emplace();
+        }
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            if (i % (decay / buffer_size) == 0) {
+                synth.prime_filter(1.0f);
+            }
+            synth.make_sound(data.data(), buffer_size);
+        }
+    });
+    char name[64];
+    snprintf(name, sizeof(name), "rest, %s%s (%llu denormal, %llu skipped)", flush ? "ftz/daz" : "default",
+             sleep ? ", sleeping" : "",
+             static_cast<unsigned long long>(synth.denormals.load()),
+             static_cast<unsigned long long>(synth.skipped_blocks.load()));
+    report(name, ms, seconds);
+}
+
+// The filter alone, with the cutoff held and with it moving every block so
+// the pole is recomputed every control block.
+void bench_cutoff(bool sweep) {
+    constexpr int seconds = 20;
+    LowPass<1> lowpass(samples_per_sec);
+    std::array<float, buffer_size> data;
+    FlushDenormals flush;
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            for (size_t j = 0; j < data.size(); j++) {
+                data[j] = ((j * 64) % 1024) / 512.0f - 1.0f;
+            }
+            for (size_t j = 0; j < data.size(); j += 32) {
+                lowpass.set(0, sweep ? 200.0f + ((i + j) % 64) * 200.0f : 4800.0f, 0.5f);
+                lowpass.process(data.data() + j, 32);
+            }
+        }
+    });
+    report(sweep ? "lowpass, cutoff sweeping" : "lowpass, cutoff held", ms, seconds);
+}
+
+// Each filter type over the same saw, per voice. Ladder and StateVariable
+// are also run 8 voices wide and with a per sample cutoff.
+template <typename F>
+void bench_filter(const char *name, F &&filter, size_t lanes, bool modulate) {
+    constexpr int seconds = 20;
+    std::vector<float> data(buffer_size * lanes);
+    std::vector<float> cutoff(buffer_size * lanes);
+    for (size_t i = 0; i < cutoff.size(); i++) {
+        cutoff[i] = 500.0f + (i % 997) * 5.0f;
+    }
+    FlushDenormals flush;
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            for (size_t j = 0; j < data.size(); j++) {
+                data[j] = ((j * 64) % 1024) / 512.0f - 1.0f;
+            }
+            filter(data.data(), modulate ? cutoff.data() : nullptr);
+        }
+    });
+    char full[128];
+    snprintf(full, sizeof(full), "%.64s x%zu%s, per voice", name, lanes, modulate ? " modulated" : "");
+    report(full, ms / lanes, seconds);
+}
+
+template <size_t Lanes>
+void bench_filters(bool modulate) {
+    Ladder<Lanes> ladder(samples_per_sec);
+    StateVariable<Lanes> svf(samples_per_sec);
+    for (size_t v = 0; v < Lanes; v++) {
+        ladder.set(v, 2000, 0.5);
+        svf.set(v, 2000, 0.5);
+    }
+    bench_filter("ladder", [&](float *data, const float *cutoff) {
+        ladder.process(data, buffer_size, cutoff);
+    }, Lanes, modulate);
+    bench_filter("state variable", [&](float *data, const float *cutoff) {
+        svf.process(data, buffer_size, cutoff);
+    }, Lanes, modulate);
+}
+
+// Each filter over a +-0.5 square wave at every cutoff and resonance on a
+// grid up to max_cutoff, counting the settings whose output ever stops
+// being finite, and the loudest output of the rest.
+template <typename Filter>
+void bench_stability(const char *name) {
+    size_t settings = 0;
+    size_t unstable = 0;
+    float peak = 0;
+    for (float hz : {1000.0f, 5000.0f, 10000.0f, 15000.0f, max_cutoff(samples_per_sec)}) {
+        for (float resonance : {0.0f, 0.5f, 0.7f, 0.9f, 0.99f}) {
+            Filter filter(samples_per_sec);
+            filter.set(0, hz, resonance);
+            std::array<float, buffer_size> data;
+            auto finite = true;
+            auto loudest = 0.0f;
+            for (size_t b = 0; b < samples_per_sec / buffer_size; b++) {
+                for (size_t i = 0; i < data.size(); i++) {
+                    data[i] = (b * buffer_size + i) / 50 % 2 ? 0.5f : -0.5f;
+                }
+                filter.process(data.data(), buffer_size);
+                for (auto x : data) {
+                    finite = finite && std::isfinite(x);
+                    loudest = std::max(loudest, std::abs(x));
+                }
+            }
+            settings++;
+            unstable += !finite;
+            peak = finite ? std::max(peak, loudest) : peak;
+        }
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "%.32s, settings not finite", name);
+    printf("%-40s %5zu of %zu, peak %.2f\n", label, unstable, settings, peak);
+}
+
+// The shaper's cost per voice at each oversampling factor, then how much
+// of a driven 9kHz sine folds back below Nyquist: everything in the
+// spectrum of the output that isn't one of its harmonics, against the
+// harmonics.
+void bench_shaper() {
+    auto worst = 0.0;
+    for (int i = -8000; i <= 8000; i++) {
+        worst = std::max(worst, std::abs(double(fast_tanh(i / 1000.0f)) - std::tanh(i / 1000.0)));
+    }
+    printf("%-40s %9.2g\n", "fast_tanh, worst error", worst);
+    for (auto curve : {ShaperCurve::Tanh, ShaperCurve::Cubic}) {
+        for (size_t oversample : {1, 2, 4}) {
+            auto shape = ShaperShape{4, curve, oversample};
+            Shaper<max_voices> shaper;
+            char name[64];
+            snprintf(name, sizeof(name), "shaper %s %zux", curve == ShaperCurve::Tanh ? "tanh" : "cubic", oversample);
+            bench_filter(name, [&](float *data, const float *) {
+                shaper.process(shape, data, buffer_size);
+            }, max_voices, false);
+        }
+    }
+    constexpr size_t n = 32768;
+    constexpr float hz = 9000;
+    for (size_t oversample : {1, 2, 4}) {
+        Shaper<max_voices> shaper;
+        std::vector<float> data((n + 4096) * max_voices);
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = 0.8f * std::sin(2 * static_cast<float>(M_PI) * hz * (i / max_voices) / samples_per_sec);
+        }
+        shaper.process(ShaperShape{4, ShaperCurve::Tanh, oversample}, data.data(), n + 4096);
+        std::vector<float> re(n), im(n);
+        for (size_t i = 0; i < n; i++) {
+            re[i] = data[(i + 4096) * max_voices] * (0.5f - 0.5f * std::cos(2 * static_cast<float>(M_PI) * i / n));
+        }
+        Fft(n).transform(re.data(), im.data(), false);
+        double harmonics = 0, rest = 0;
+        for (size_t k = 1; k < n / 2; k++) {
+            auto power = double(re[k]) * re[k] + double(im[k]) * im[k];
+            auto harmonic = std::fmod(k * samples_per_sec / double(n) + hz / 2, hz) - hz / 2;
+            (std::abs(harmonic) < 30 ? harmonics : rest) += power;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "shaper %zux, 9kHz aliasing", oversample);
+        printf("%-40s %9.1f dB\n", name, 10 * std::log10(rest / harmonics));
+    }
+}
+
+// The EQ over 1 to 64 lanes, and with the shape changing every block so
+// the coefficients are always gliding.
+template <size_t Lanes>
+void bench_eq(size_t bands, bool glide) {
+    Equalizer<Lanes> eq(samples_per_sec);
+    auto shape = EqShape();
+    shape.count = bands;
+    for (size_t b = 0; b < bands; b++) {
+        shape.bands[b] = {BandType::Peak, 200.0f * (b + 1), 3, 1};
+    }
+    eq.set_shape(shape);
+    eq.clear();
+    auto other = shape;
+    for (size_t b = 0; b < bands; b++) {
+        other.bands[b].gain = -3;
+    }
+    size_t blocks = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "eq %zu band%s%s", bands, bands > 1 ? "s" : "", glide ? " gliding" : "");
+    bench_filter(name, [&](float *data, const float *) {
+        if (glide) {
+            eq.set_shape(++blocks % 2 ? other : shape);
+        }
+        eq.process(data, buffer_size);
+    }, Lanes, false);
+}
+
+void bench_eqs() {
+    for (size_t bands : {1, 4, 8}) {
+        bench_eq<1>(bands, false);
+        bench_eq<2>(bands, false);
+        bench_eq<8>(bands, false);
+        bench_eq<16>(bands, false);
+        bench_eq<64>(bands, false);
+    }
+    bench_eq<8>(8, true);
+    bench_eq<64>(8, true);
+}
+
+// Eight envelopes with notes starting and stopping every few hundred
+// samples, so most blocks contain several segment boundaries.
+void bench_envelope() {
+    constexpr int seconds = 20;
+    Envelope<max_voices> envelope(samples_per_sec);
+    envelope.set_shape(EnvelopeShape::adsr(0.002f, 0.01f, 0.5f, 0.005f));
+    std::vector<float> out(buffer_size * max_voices);
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            for (size_t j = 0; j < buffer_size; j += 256) {
+                auto v = (i * 4 + j / 256) % max_voices;
+                envelope.gate_off((v + max_voices / 2) % max_voices);
+                envelope.gate_on(v);
+                envelope.process(out.data() + j * max_voices, 256);
+            }
+        }
+    });
+    report("envelope x8, per voice", ms / max_voices, seconds);
+}
+
+// The voice sources alone, eight voices at once, reported per voice.
+void bench_oscillator(const char *name, Oscillator oscillator, const FmShape &shape,
+                      std::shared_ptr<const WavetableBank> bank, const Unison &unison = {},
+                      NoiseColor noise = NoiseColor::White) {
+    constexpr int seconds = 20;
+    Synth synth;
+    synth.oscillator = oscillator;
+    synth.fm.set_shape(shape);
+    synth.wavetable.bank = bank;
+    synth.wave_position = 0.4f;
+    synth.sawtooth.set_unison(unison);
+    synth.noise.color = noise;
+    for (size_t v = 0; v < max_voices; v++) {
+        synth.sawtooth.start(v, 110.0f * (v + 1), 0);
+        synth.fm.start(v);
+        synth.noise.start(v, v);
+    }
+    std::vector<float> out(buffer_size * max_voices);
+    std::vector<float> side(buffer_size * max_voices);
+    auto wide = synth.sawtooth.spreading() ? side.data() : nullptr;
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            synth.oscillate(out.data(), buffer_size, wide);
+        }
+    });
+    report(name, ms / max_voices, seconds);
+}
+
+void bench_oscillators() {
+    bench_oscillator("sawtooth x8, per voice", Oscillator::SawTooth, {}, {});
+    bench_oscillator("supersaw 2 spread x8, per voice", Oscillator::SawTooth, {}, {}, {2, 20, 0.5f});
+    bench_oscillator("supersaw 4 spread x8, per voice", Oscillator::SawTooth, {}, {}, {4, 20, 0.5f});
+    bench_oscillator("supersaw 8 centred x8, per voice", Oscillator::SawTooth, {}, {}, {8, 20, 0});
+    bench_oscillator("supersaw 8 spread x8, per voice", Oscillator::SawTooth, {}, {}, {8, 20, 0.5f});
+    bench_oscillator("noise x8, per voice", Oscillator::Noise, {}, {});
+    bench_oscillator("pink noise x8, per voice", Oscillator::Noise, {}, {}, {}, NoiseColor::Pink);
+    bench_oscillator("fm 4 op stack x8, per voice", Oscillator::Fm,
+                     FmShape::algorithm(FmAlgorithm::Stack, 4), {});
+    auto feedback = FmShape::algorithm(FmAlgorithm::Stack, 6);
+    feedback.feedback = 0.5f;
+    bench_oscillator("fm 6 op stack x8, per voice", Oscillator::Fm, feedback, {});
+    bench_oscillator("fm 6 op parallel x8, per voice", Oscillator::Fm,
+                     FmShape::algorithm(FmAlgorithm::Parallel, 6), {});
+
+    auto path = "/tmp/bench.wavetable";
+    auto cycles = basic_wavetables(64, 2048);
+    if (!write_wavetable_bank(path, cycles.data(), 64, 2048)) {
+        return;
+    }
+    std::shared_ptr<WavetableBank> bank;
+    auto ms = time_ms([&]() {
+        bank = WavetableBank::open(path);
+    });
+    printf("%-40s %9.3f ms  %zu bytes\n", "wavetable bank open", ms, bank ? bank->size : 0);
+    if (bank) {
+        bench_oscillator("wavetable x8, per voice", Oscillator::Wavetable, {}, bank);
+    }
+    unlink(path);
+}
+
+// The kit playing the groove, and a busy track with kick, snare and hat on
+// every step so all three drums always ring, against one voice of the
+// default saw through the lowpass (the whole voice chain eight voices wide,
+// per voice).
+void bench_drum(const char *name, const DrumShape &shape) {
+    constexpr int seconds = 20;
+    std::array<float, buffer_size * channels> data;
+    FlushDenormals flush;
+    Synth kit;
+    kit.drums.set_shape(shape);
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            std::fill(data.begin(), data.end(), 0.0f);
+            kit.render_drums(i * buffer_size, data.data(), buffer_size);
+        }
+    });
+    report(name, ms, seconds);
+}
+
+void bench_drums() {
+    constexpr int seconds = 20;
+    std::array<float, buffer_size * channels> data;
+    FlushDenormals flush;
+    Synth voices;
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            voices.render_voices(i * buffer_size, data.data(), buffer_size);
+        }
+    });
+    report("saw + lowpass x8, per voice", ms / max_voices, seconds);
+    bench_drum("drums, groove", DrumShape::groove());
+    auto busy = DrumShape();
+    std::fill(busy.steps, busy.steps + 8, DrumHit::kick | DrumHit::snare | DrumHit::closed_hat);
+    bench_drum("drums, every drum on every step", busy);
+}
+
+// The whole synth on each instruction set path, with the largest
+// difference in the output from the default path.
+void bench_isa(const char *name, const Patch &patch) {
+    constexpr int seconds = 20;
+    std::vector<int16_t> reference;
+    for (auto isa : {Isa::Default, Isa::Scalar}) {
+        Synth synth;
+        synth.cache_loops = false;
+        synth.isa = isa;
+        synth.load(patch);
+        std::vector<int16_t> data(seconds * samples_per_sec / buffer_size * buffer_size * channels);
+        auto ms = time_ms([&]() {
+            FlushDenormals flush;
+            for (size_t i = 0; i < data.size(); i += buffer_size * channels) {
+                synth.make_sound(data.data() + i, buffer_size);
+            }
+        });
+        if (reference.empty()) {
+            reference = data;
+        }
+        int worst = 0;
+        for (size_t i = 0; i < data.size(); i++) {
+            worst = std::max(worst, std::abs(data[i] - reference[i]));
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "%s, %s (%d lsb off)", name, isa_name(isa), worst);
+        report(label, ms, seconds);
+    }
+}
+
+void bench_dispatch() {
+    bench_isa("saw + lowpass", Patch());
+    // unison, a voice eq, the groove and the reverb
+    auto busy = Patch();
+    busy.unison.count = 3;
+    busy.eq.count = 1;
+    busy.eq.bands[0] = {BandType::Peak, 800, 6, 2};
+    busy.effects.reverb.mix = 0.2f;
+    busy.drums = DrumShape::groove();
+    bench_isa("busy patch", busy);
+}
+
+// A long offline render split across more and more threads, with an LFO
+// on the cutoff and pitch so the loop cache can't help, and the largest
+// difference from the render on one thread.
+void bench_offline() {
+    constexpr int seconds = 120;
+    constexpr uint64_t frames = seconds * samples_per_sec;
+    auto patch = Patch();
+    patch.mod.lfo[0] = {5, LfoShape::Sine};
+    patch.mod.lfo[1] = {0.3f, LfoShape::Triangle};
+    patch.mod.add(ModSource::Lfo1, ModDest::Pitch, 0.2f);
+    patch.mod.add(ModSource::Lfo2, ModDest::Cutoff, 1.5f);
+    std::vector<int16_t> serial(frames * channels);
+    std::vector<int16_t> out(frames * channels);
+    auto cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    printf("%-40s %9zu\n", "cores", cores);
+    for (size_t threads = 1; threads <= std::max<size_t>(cores, 8); threads *= 2) {
+        auto &data = threads == 1 ? serial : out;
+        auto ms = time_ms([&]() {
+            auto at = data.data();
+            render_offline(patch, Synth::Sequencer(), frames, threads, [&](const int16_t *chunk, uint64_t n) {
+                at = std::copy(chunk, chunk + n * channels, at);
+            });
+        });
+        int worst = 0;
+        for (size_t i = 0; i < data.size(); i++) {
+            worst = std::max(worst, std::abs(data[i] - serial[i]));
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "offline, %zu threads (%d lsb off)", threads, worst);
+        report(name, ms, seconds);
+    }
+}
+
+// A batch of short renders of a few patches and patterns to /tmp, on one
+// thread and then on every core, as audio seconds rendered per second.
+void bench_batch() {
+    constexpr size_t count = 32;
+    constexpr double seconds = 5;
+    auto cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t threads : {size_t(1), std::max<size_t>(cores, 2)}) {
+        std::vector<RenderJob> jobs(count);
+        for (size_t i = 0; i < count; i++) {
+            auto &job = jobs[i];
+            job.path = "/tmp/bench_batch_" + std::to_string(i) + ".wav";
+            job.seconds = seconds;
+            job.sequencer.bpm = 100 + 10 * (i % 8);
+            job.sequencer.pattern[1] = 110.0f * (i % 4 + 1);
+            if (i % 4 == 1) {
+                job.patch.drums = DrumShape::groove();
+            } else if (i % 4 == 2) {
+                job.patch.unison.count = 5;
+                job.patch.effects.chorus = SweepShape::chorus(0.5f);
+            } else if (i % 4 == 3) {
+                job.patch.filter = FilterType::Ladder;
+                job.patch.effects.reverb.mix = 0.3f;
+            }
+        }
+        auto ms = time_ms([&]() {
+            render_batch(jobs, threads);
+        });
+        auto slowest = std::max_element(jobs.begin(), jobs.end(), [](auto &a, auto &b) { return a.ms < b.ms; });
+        auto written = std::all_of(jobs.begin(), jobs.end(), [](auto &job) { return job.ok; });
+        char name[64];
+        snprintf(name, sizeof(name), "batch of %zu, %zu threads%s", count, threads, written ? "" : " (failed)");
+        report(name, ms, count * seconds);
+        printf("%-40s %9.3f ms\n", "  slowest job", slowest->ms);
+        for (auto &job : jobs) {
+            unlink(job.path.c_str());
+        }
+    }
+}
+
+// Opening a library whose pages were dropped from the cache, then the
+// sampler voice alone with everything resident, then a few seconds of the
+// whole synth paced at realtime from cold so the streamer has to keep up.
+void bench_sampler() {
+    constexpr int seconds = 20;
+    constexpr int paced_seconds = 3;
+    auto path = "/tmp/bench.samples";
+    auto plucked = plucked_samples(5, samples_per_sec, 4);
+    std::vector<SampleSource> sources;
+    for (size_t s = 0; s < plucked.size(); s++) {
+        sources.push_back({plucked[s].data(), plucked[s].size(), 110.0f * (1u << s)});
+    }
+    if (!write_sample_library(path, samples_per_sec, sources)) {
+        return;
+    }
+    auto evict = [&]() {
+        auto fd = open(path, O_RDONLY);
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    };
+    evict();
+    std::shared_ptr<SampleLibrary> library;
+    auto ms = time_ms([&]() {
+        library = SampleLibrary::open(path);
+    });
+    if (!library) {
+        return;
+    }
+    printf("%-40s %9.3f ms  %zu bytes%s\n", "sample library open, cold", ms, library->size,
+           library->locked ? ", attacks locked" : "");
+
+    {
+        Synth synth;
+        synth.oscillator = Oscillator::Sampler;
+        synth.sampler.set_library(library);
+        for (size_t v = 0; v < max_voices; v++) {
+            synth.sawtooth.start(v, 110.0f * (v + 1), 0);
+            synth.sampler.start(v, 110.0f * (v + 1));
+            SampleLibrary::touch(library->pcm(synth.sampler.sample[v]),
+                                 library->pcm(synth.sampler.sample[v]) + library->entries[synth.sampler.sample[v]].frames);
+        }
+        std::vector<float> out(buffer_size * max_voices);
+        ms = time_ms([&]() {
+            for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+                if (i % (2 * samples_per_sec / buffer_size) == 0) {
+                    for (size_t v = 0; v < max_voices; v++) {
+                        synth.sampler.start(v, 110.0f * (v + 1));
+                    }
+                }
+                synth.oscillate(out.data(), buffer_size);
+            }
+        });
+        report("sampler x8, per voice", ms / max_voices, seconds);
+    }
+
+    library.reset();
+    evict();
+    auto patch = Patch();
+    patch.oscillator = Oscillator::Sampler;
+    patch.samples = SampleLibrary::open(path);
+    Synth synth;
+    synth.cache_loops = false;
+    synth.load(patch);
+    std::array<int16_t, buffer_size * channels> data;
+    auto block = std::chrono::microseconds(1000000 * buffer_size / samples_per_sec);
+    auto next = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < paced_seconds * samples_per_sec / buffer_size; i++) {
+        synth.make_sound(data.data(), buffer_size);
+        next += block;
+        std::this_thread::sleep_until(next);
+    }
+    printf("%-40s %9llu underruns\n", "sampler, paced from cold",
+           static_cast<unsigned long long>(patch.samples->underruns.load()));
+    synth.sampler.set_library({});
+    patch.samples.reset();
+    unlink(path);
+}
+
+// The whole synth with nothing routed, then with LFOs on pitch, cutoff and
+// pan and the envelope on volume, evaluated every control_block samples.
+void bench_modulation(size_t control_block, bool routed) {
+    constexpr int seconds = 20;
+    auto patch = Patch();
+    patch.filter = FilterType::Ladder;
+    patch.mod.control_block = control_block;
+    if (routed) {
+        patch.mod.lfo[0] = {5, LfoShape::Sine};
+        patch.mod.lfo[1] = {0.3f, LfoShape::Triangle};
+        patch.mod.add(ModSource::Lfo1, ModDest::Pitch, 0.2f);
+        patch.mod.add(ModSource::Lfo2, ModDest::Cutoff, 1.5f);
+        patch.mod.add(ModSource::Lfo2, ModDest::Pan, 0.8f);
+        patch.mod.add(ModSource::Envelope, ModDest::Volume, -0.3f);
+    }
+    Synth synth;
+    synth.cache_loops = false;
+    synth.load(patch);
+    std::array<int16_t, buffer_size * channels> data;
+    auto ms = time_ms([&]() {
+        FlushDenormals flush;
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            synth.make_sound(data.data(), buffer_size);
+        }
+    });
+    char name[64];
+    if (routed) {
+        snprintf(name, sizeof(name), "modulation, every %zu", control_block);
+    } else {
+        snprintf(name, sizeof(name), "modulation, none");
+    }
+    report(name, ms, seconds);
+}
+
+// Each effect alone on a stereo noise, the echo at a short and a long
+// delay to show the cost does not depend on it.
+Effects bench_effect(const char *name, const EffectsShape &shape,
+                     std::shared_ptr<const ImpulseResponse> impulse = {}) {
+    constexpr int seconds = 20;
+    Effects effects(samples_per_sec);
+    effects.set_shape(shape);
+    effects.set_impulse(std::move(impulse));
+    std::vector<float> noise(buffer_size * channels), data(noise.size());
+    uint32_t state = 1;
+    for (auto &x : noise) {
+        state = state * 1664525 + 1013904223;
+        x = (state >> 8) * (1.0f / (1u << 23)) - 1.0f;
+    }
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            std::copy(noise.begin(), noise.end(), data.begin());
+            effects.process(data.data(), buffer_size, i * buffer_size);
+        }
+    });
+    report(name, ms, seconds);
+    return effects;
+}
+
+void bench_effects() {
+    auto echo = [](float seconds) {
+        auto shape = EffectsShape();
+        shape.echo = {seconds, seconds, 0.35f, 0.3f};
+        return shape;
+    };
+    bench_effect("echo, 10 ms", echo(0.01f));
+    bench_effect("echo, 1.9 s", echo(1.9f));
+    auto chorus = EffectsShape();
+    chorus.chorus = SweepShape::chorus(0.5f);
+    bench_effect("chorus", chorus);
+    auto flanger = EffectsShape();
+    flanger.flanger = SweepShape::flanger(0.5f);
+    bench_effect("flanger", flanger);
+    auto reverb = EffectsShape();
+    reverb.reverb.mix = 0.3f;
+    bench_effect("reverb, 8 lines", reverb);
+}
+
+// The master bus over noise that is loud for a second in every three, with
+// the odd spike; the lookaheads show the sliding max costs the same however
+// wide its window. Also the worst peak out, which must stay at the ceiling.
+void bench_dynamic(const char *name, const DynamicsShape &shape) {
+    constexpr int seconds = 20;
+    Dynamics dynamics(samples_per_sec);
+    dynamics.set_shape(shape);
+    std::vector<float> noise(samples_per_sec * 3 * channels), data(buffer_size * channels);
+    uint32_t state = 1;
+    for (size_t i = 0; i < noise.size(); i++) {
+        state = state * 1664525 + 1013904223;
+        auto loud = i < noise.size() / 3 ? 4.0f : 0.3f;
+        auto spike = state % 97 == 0 ? 3.0f : 1.0f;
+        noise[i] = ((state >> 8) * (1.0f / (1u << 23)) - 1.0f) * loud * spike;
+    }
+    auto worst = 0.0f;
+    auto ms = time_ms([&]() {
+        for (size_t i = 0; i < seconds * samples_per_sec / buffer_size; i++) {
+            auto from = i * buffer_size * channels % (noise.size() - data.size());
+            std::copy(noise.begin() + from, noise.begin() + from + data.size(), data.begin());
+            dynamics.process(data.data(), buffer_size);
+            for (auto x : data) {
+                worst = std::max(worst, std::abs(x));
+            }
+        }
+    });
+    char full[80];
+    snprintf(full, sizeof(full), "%s (peak %.2f dB)", name, 20 * std::log10(worst));
+    report(full, ms, seconds);
+}
+
+void bench_dynamics() {
+    auto limiter = [](float lookahead) {
+        auto shape = DynamicsShape();
+        shape.limiter.lookahead = lookahead;
+        return shape;
+    };
+    bench_dynamic("limiter, 0.5 ms lookahead", limiter(0.0005f));
+    bench_dynamic("limiter, 2 ms lookahead", limiter(0.002f));
+    bench_dynamic("limiter, 10 ms lookahead", limiter(0.01f));
+    auto compressor = DynamicsShape();
+    compressor.compressor.ratio = 4;
+    compressor.limiter.on = false;
+    bench_dynamic("compressor 4:1", compressor);
+    compressor.limiter.on = true;
+    compressor.compressor.makeup = 12;
+    bench_dynamic("compressor 4:1 +12 dB, limiter", compressor);
+}
+
+// Stereo IRs of decaying noise written out and loaded back, so the load
+// time covers reading, resampling and transforming the partitions.
+void bench_convolution() {
+    for (int seconds : {1, 4, 10}) {
+        auto frames = static_cast<size_t>(seconds * samples_per_sec);
+        std::vector<int16_t> samples(frames * 2);
+        uint32_t state = 1;
+        for (size_t i = 0; i < samples.size(); i++) {
+            state = state * 1664525 + 1013904223;
+            auto decay = std::exp2(-10.0f * (i / 2) / frames);
+            samples[i] = static_cast<int16_t>(((state >> 8) * (1.0f / (1u << 23)) - 1.0f) * decay * 16000);
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/bench_ir_%ds.wav", seconds);
+        if (!write_wav(path, samples.data(), frames, 2, samples_per_sec)) {
+            continue;
+        }
+        std::shared_ptr<ImpulseResponse> impulse;
+        auto ms = time_ms([&]() {
+            impulse = ImpulseResponse::load(path, samples_per_sec);
+        });
+        char name[64];
+        snprintf(name, sizeof(name), "convolution, %d s IR, load", seconds);
+        printf("%-40s %9.1f ms\n", name, ms);
+        remove(path);
+        if (!impulse) {
+            continue;
+        }
+        auto shape = EffectsShape();
+        shape.convolution.mix = 0.3f;
+        snprintf(name, sizeof(name), "convolution, %d s IR", seconds);
+        auto effects = bench_effect(name, shape, impulse);
+        printf("%-40s %9llu\n", "  blocks late",
+               static_cast<unsigned long long>(effects.convolution.convolver->late.load()));
+    }
+}
+
+// Worst error of fast_exp2 against std::exp2 over +-4 octaves, and of it
+// and the note table for MIDI note increments, in relative terms and in
+// cents, then their cost per call.
+void bench_pitch() {
+    constexpr size_t calls = 20 * samples_per_sec * max_voices;
+    auto cents = [](double error) {
+        return 1200 * std::log2(1 + error);
+    };
+    double fast_error = 0;
+    for (int i = -48000; i <= 48000; i++) {
+        auto x = i / 1000.0f;
+        auto exact = std::exp2(double(x) / 12);
+        fast_error = std::max(fast_error, std::abs(fast_exp2(x / 12) / exact - 1));
+    }
+    printf("%-40s %9.2g     %8.4f cents\n", "fast_exp2, worst error", fast_error, cents(fast_error));
+    constexpr auto a4 = 440.0f * 2 / samples_per_sec;
+    double table_error = 0;
+    double note_error = 0;
+    for (int note = 0; note < NoteTable<samples_per_sec>::notes; note++) {
+        auto exact = 440.0 * 2 / samples_per_sec * std::exp2((note - 69) / 12.0);
+        table_error = std::max(table_error, std::abs(note_table[note] / exact - 1));
+        note_error = std::max(note_error, std::abs(a4 * fast_exp2((note - 69) / 12.0f) / exact - 1));
+    }
+    printf("%-40s %9.2g     %8.4f cents\n", "note table, worst error", table_error, cents(table_error));
+    printf("%-40s %9.2g     %8.4f cents\n", "fast_exp2 notes, worst error", note_error, cents(note_error));
+
+    auto per_call = [&](const char *name, auto input, auto &&f) {
+        std::vector<decltype(input(0))> in(buffer_size * max_voices);
+        std::vector<float> out(in.size());
+        for (size_t i = 0; i < in.size(); i++) {
+            in[i] = input(i);
+        }
+        auto ms = time_ms([&]() {
+            for (size_t n = 0; n < calls; n += in.size()) {
+                for (size_t i = 0; i < in.size(); i++) {
+                    out[i] = f(in[i]);
+                }
+                in[n / in.size() % in.size()] += out[0] > 1e30f;
+            }
+        });
+        printf("%-40s %9.3f ns\n", name, ms * 1e6 / calls);
+    };
+    auto offsets = [](size_t i) {
+        return (i * 37 % 9600) * 0.01f - 48;
+    };
+    auto notes = [](size_t i) {
+        return static_cast<int>(i * 37 % 128);
+    };
+    per_call("copy, per call", offsets, [](float x) { return x; });
+    per_call("std::exp2, per call", offsets, [](float x) { return std::exp2(x / 12); });
+    per_call("fast_exp2, per call", offsets, [](float x) { return fast_exp2(x / 12); });
+    per_call("note by fast_exp2, per call", notes, [&](int note) { return a4 * fast_exp2((note - 69) / 12.0f); });
+    per_call("note by table, per call", notes, [](int note) { return note_table[note]; });
+}
+
+int main(int argc, char **argv) {
+    auto wanted = [&](const char *name) {
+        return argc < 2 || strstr(name, argv[1]);
+    };
+    if (wanted("rest")) {
+        bench_rest(false, false);
+        bench_rest(true, false);
+        bench_rest(false, true);
+    }
+    if (wanted("cutoff")) {
+        bench_cutoff(false);
+        bench_cutoff(true);
+    }
+    if (wanted("filter")) {
+        LowPass<1> lowpass(samples_per_sec);
+        lowpass.set(0, 2000, 0.5);
+        bench_filter("lowpass", [&](float *data, const float *) {
+            lowpass.process(data, buffer_size);
+        }, 1, false);
+        bench_filters<1>(false);
+        bench_filters<8>(false);
+        bench_filters<1>(true);
+        bench_filters<8>(true);
+        bench_stability<LowPass<1>>("lowpass");
+        bench_stability<Ladder<1>>("ladder");
+        bench_stability<StateVariable<1>>("state variable");
+    }
+    if (wanted("shaper")) {
+        bench_shaper();
+    }
+    if (wanted("eq")) {
+        bench_eqs();
+    }
+    if (wanted("envelope")) {
+        bench_envelope();
+    }
+    if (wanted("oscillator")) {
+        bench_oscillators();
+    }
+    if (wanted("drums")) {
+        bench_drums();
+    }
+    if (wanted("dispatch")) {
+        bench_dispatch();
+    }
+    if (wanted("offline")) {
+        bench_offline();
+    }
+    if (wanted("batch")) {
+        bench_batch();
+    }
+    if (wanted("sampler")) {
+        bench_sampler();
+    }
+    if (wanted("effects")) {
+        bench_effects();
+    }
+    if (wanted("dynamics")) {
+        bench_dynamics();
+    }
+    if (wanted("convolution")) {
+        bench_convolution();
+    }
+    if (wanted("pitch")) {
+        bench_pitch();
+    }
+    if (wanted("modulation")) {
+        bench_modulation(32, false);
+        bench_modulation(32, true);
+        bench_modulation(1, true);
+    }
+    return 0;
+}
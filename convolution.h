@@ -0,0 +1,510 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "wav.h"
+
+// In place radix-2 FFT on split real and imaginary arrays, unscaled. The
+// twiddles for butterflies h apart sit together at [h, 2h), so the inner
+// loop runs straight along them.
+struct Fft {
+    size_t size;
+    std::vector<uint32_t> reversed;
+    std::vector<float> twiddle_re;
+    std::vector<float> twiddle_im;
+
+    explicit Fft(size_t n) : size(n), reversed(n), twiddle_re(n), twiddle_im(n) {
+        auto bits = std::countr_zero(n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t r = 0;
+            for (int b = 0; b < bits; b++) {
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+            reversed[i] = r;
+        }
+        for (size_t h = 1; h < n; h *= 2) {
+            for (size_t k = 0; k < h; k++) {
+                twiddle_re[h + k] = std::cos(M_PI * k / h);
+                twiddle_im[h + k] = -std::sin(M_PI * k / h);
+            }
+        }
+    }
+
+    void transform(float *re, float *im, bool inverse) const {
+        for (size_t i = 0; i < size; i++) {
+            auto j = reversed[i];
+            if (i < j) {
+                std::swap(re[i], re[j]);
+                std::swap(im[i], im[j]);
+            }
+        }
+        auto sign = inverse ? -1.0f : 1.0f;
+        for (size_t h = 1; h < size; h *= 2) {
+            auto wr = twiddle_re.data() + h;
+            auto wi = twiddle_im.data() + h;
+            for (size_t start = 0; start < size; start += 2 * h) {
+                auto ar = re + start;
+                auto ai = im + start;
+                auto br = ar + h;
+                auto bi = ai + h;
+                for (size_t k = 0; k < h; k++) {
+                    auto xr = br[k] * wr[k] - bi[k] * wi[k] * sign;
+                    auto xi = br[k] * wi[k] * sign + bi[k] * wr[k];
+                    br[k] = ar[k] - xr;
+                    bi[k] = ai[k] - xi;
+                    ar[k] += xr;
+                    ai[k] += xi;
+                }
+            }
+        }
+    }
+};
+
+// Part of an IR cut into count blocks of block samples, each transformed
+// at twice the block with the inverse's 1/N folded in.
+//
+// The stereo signal l, r is convolved as the one complex signal l + ir.
+// With X its spectrum and Xm(k) = conj(X(N - k)), l's spectrum is
+// (X + Xm) / 2 and r's is (X - Xm) / 2i, so left through the IR's left
+// and right through its right is X A + Xm B with A the mean and B half
+// the difference of the two channels' spectra. A mono IR has no B.
+struct Partitions {
+    size_t block;
+    size_t count;
+    bool stereo;
+    Fft fft;
+    std::vector<float> a_re;
+    std::vector<float> a_im;
+    std::vector<float> b_re;
+    std::vector<float> b_im;
+
+    Partitions(const float *left, const float *right, size_t length, size_t block_size) :
+        block(block_size), count((length + block_size - 1) / block_size), stereo(left != right),
+        fft(2 * block_size) {
+        auto n = 2 * block;
+        a_re.resize(count * n);
+        a_im.resize(count * n);
+        if (stereo) {
+            b_re.resize(count * n);
+            b_im.resize(count * n);
+        }
+        std::vector<float> lr(n), li(n), rr(n), ri(n);
+        for (size_t p = 0; p < count; p++) {
+            auto from = p * block;
+            auto take = std::min(block, length - from);
+            std::fill(lr.begin(), lr.end(), 0.0f);
+            std::fill(li.begin(), li.end(), 0.0f);
+            std::copy(left + from, left + from + take, lr.begin());
+            fft.transform(lr.data(), li.data(), false);
+            if (stereo) {
+                std::fill(rr.begin(), rr.end(), 0.0f);
+                std::fill(ri.begin(), ri.end(), 0.0f);
+                std::copy(right + from, right + from + take, rr.begin());
+                fft.transform(rr.data(), ri.data(), false);
+            }
+            auto scale = 1.0f / n;
+            for (size_t k = 0; k < n; k++) {
+                auto at = p * n + k;
+                if (stereo) {
+                    a_re[at] = (lr[k] + rr[k]) * 0.5f * scale;
+                    a_im[at] = (li[k] + ri[k]) * 0.5f * scale;
+                    b_re[at] = (lr[k] - rr[k]) * 0.5f * scale;
+                    b_im[at] = (li[k] - ri[k]) * 0.5f * scale;
+                } else {
+                    a_re[at] = lr[k] * scale;
+                    a_im[at] = li[k] * scale;
+                }
+            }
+        }
+    }
+};
+
+// An IR split into tiers of growing blocks. Tier i covers the IR from
+// starts[i], which is twice its block, so a block of input gives a whole
+// block of time to compute the tier's output before the first of it is due.
+struct ImpulseResponse {
+    static constexpr size_t tiers = 3;
+    static constexpr size_t blocks[tiers] = {128, 2048, 16384};
+    static constexpr size_t starts[tiers] = {0, 2 * 2048, 2 * 16384};
+    size_t length = 0;
+    std::vector<std::unique_ptr<Partitions>> parts;
+
+    // right == left for a mono IR
+    static std::shared_ptr<ImpulseResponse> make(const float *left, const float *right, size_t length) {
+        auto ir = std::make_shared<ImpulseResponse>();
+        ir->length = length;
+        for (size_t t = 0; t < tiers && starts[t] < length; t++) {
+            auto end = t + 1 < tiers ? std::min(length, starts[t + 1]) : length;
+            ir->parts.push_back(std::make_unique<Partitions>(left + starts[t], right + starts[t],
+                                                             end - starts[t], blocks[t]));
+        }
+        return ir;
+    }
+
+    // Loads a mono or stereo wav, resampled linearly to rate if need be.
+    static std::shared_ptr<ImpulseResponse> load(const char *path, uint32_t rate) {
+        Wav wav;
+        if (!read_wav(path, wav)) {
+            return {};
+        }
+        if (!wav.frames()) {
+            printf("%s is empty\n", path);
+            return {};
+        }
+        auto frames = std::max<size_t>(1, static_cast<double>(wav.frames()) * rate / wav.rate);
+        std::vector<float> left(frames), right(frames);
+        auto stereo = wav.channels > 1;
+        for (size_t i = 0; i < frames; i++) {
+            auto at = static_cast<double>(i) * wav.rate / rate;
+            auto whole = std::min(static_cast<size_t>(at), wav.frames() - 1);
+            auto next = std::min(whole + 1, wav.frames() - 1);
+            auto fraction = static_cast<float>(at - whole);
+            auto sample = [&](size_t frame, size_t channel) {
+                return wav.samples[frame * wav.channels + channel];
+            };
+            left[i] = sample(whole, 0) + (sample(next, 0) - sample(whole, 0)) * fraction;
+            if (stereo) {
+                right[i] = sample(whole, 1) + (sample(next, 1) - sample(whole, 1)) * fraction;
+            }
+        }
+        return make(left.data(), stereo ? right.data() : left.data(), frames);
+    }
+};
+
+// Uniformly partitioned overlap-save over one tier: each block of input is
+// transformed once into a frequency domain delay line, and the output is
+// the sum over partitions of the line times the IR, transformed back.
+struct Segment {
+    const Partitions *ir;
+    std::vector<float> window_re;
+    std::vector<float> window_im;
+    std::vector<float> x_re;
+    std::vector<float> x_im;
+    std::vector<float> xm_re;
+    std::vector<float> xm_im;
+    std::vector<float> y_re;
+    std::vector<float> y_im;
+    size_t newest = 0;
+
+    explicit Segment(const Partitions &partitions) :
+        ir(&partitions),
+        window_re(2 * ir->block), window_im(2 * ir->block),
+        x_re(ir->count * 2 * ir->block), x_im(x_re.size()),
+        xm_re(ir->stereo ? x_re.size() : 0), xm_im(xm_re.size()),
+        y_re(2 * ir->block), y_im(2 * ir->block) {}
+
+    void clear() {
+        for (auto *v : {&window_re, &window_im, &x_re, &x_im, &xm_re, &xm_im}) {
+            std::fill(v->begin(), v->end(), 0.0f);
+        }
+        newest = 0;
+    }
+
+    // block interleaved stereo frames in, the same of wet signal out
+    void push(const float *in, float *out) {
+        auto block = ir->block;
+        auto n = 2 * block;
+        std::copy(window_re.begin() + block, window_re.end(), window_re.begin());
+        std::copy(window_im.begin() + block, window_im.end(), window_im.begin());
+        for (size_t i = 0; i < block; i++) {
+            window_re[block + i] = in[i * 2];
+            window_im[block + i] = in[i * 2 + 1];
+        }
+        newest = (newest + ir->count - 1) % ir->count;
+        auto xr = x_re.data() + newest * n;
+        auto xi = x_im.data() + newest * n;
+        std::copy(window_re.begin(), window_re.end(), xr);
+        std::copy(window_im.begin(), window_im.end(), xi);
+        ir->fft.transform(xr, xi, false);
+        if (ir->stereo) {
+            auto mr = xm_re.data() + newest * n;
+            auto mi = xm_im.data() + newest * n;
+            mr[0] = xr[0];
+            mi[0] = -xi[0];
+            for (size_t k = 1; k < n; k++) {
+                mr[k] = xr[n - k];
+                mi[k] = -xi[n - k];
+            }
+        }
+
+        std::fill(y_re.begin(), y_re.end(), 0.0f);
+        std::fill(y_im.begin(), y_im.end(), 0.0f);
+        auto yr = y_re.data();
+        auto yi = y_im.data();
+        for (size_t p = 0; p < ir->count; p++) {
+            auto slot = (newest + p) % ir->count * n;
+            multiply_add(x_re.data() + slot, x_im.data() + slot,
+                         ir->a_re.data() + p * n, ir->a_im.data() + p * n, yr, yi, n);
+            if (ir->stereo) {
+                multiply_add(xm_re.data() + slot, xm_im.data() + slot,
+                             ir->b_re.data() + p * n, ir->b_im.data() + p * n, yr, yi, n);
+            }
+        }
+        ir->fft.transform(yr, yi, true);
+        for (size_t i = 0; i < block; i++) {
+            out[i * 2] = yr[block + i];
+            out[i * 2 + 1] = yi[block + i];
+        }
+    }
+
+    static void multiply_add(const float *__restrict xr, const float *__restrict xi,
+                             const float *__restrict hr, const float *__restrict hi,
+                             float *__restrict yr, float *__restrict yi, size_t n) {
+        for (size_t k = 0; k < n; k++) {
+            yr[k] += xr[k] * hr[k] - xi[k] * hi[k];
+            yi[k] += xr[k] * hi[k] + xi[k] * hr[k];
+        }
+    }
+};
+
+// Runs an ImpulseResponse over a stereo stream, adding the wet signal
+// blocks[0] frames late. The first tier runs inline; the later ones are
+// posted a block at a time to a worker thread through a fixed queue, so
+// the render thread never locks or allocates. Each output slot carries the
+// index of the block in it, written around the block as in shm_ring.h, so
+// a block the worker hasn't finished (or has since overwritten) is seen
+// as such. When waiting, process waits for the worker to catch up, so the
+// output is the same however fast it is rendered. Otherwise, as live
+// playback can't wait, a late block is mixed as silence and counted in
+// late, and a block whose input slot the worker is still reading is
+// posted as silence, keeping the tail in time. late counts only those.
+struct Convolver {
+    static constexpr size_t slots = 4;
+    static constexpr size_t queue_size = 2 * slots * ImpulseResponse::tiers;
+    struct Tier {
+        Segment segment;
+        size_t block;
+        size_t start;
+        std::vector<float> input;
+        std::vector<float> output;
+        // index + 1 of the block in each output slot, ~0 while written
+        std::atomic<uint64_t> holds[slots] = {};
+        // the render thread's: the block being filled, whether it is being
+        // dropped, and the blocks posted whose input may still be read
+        size_t filled = 0;
+        uint64_t index = 0;
+        bool dropping = false;
+        uint64_t pending[slots] = {};
+        size_t waiting = 0;
+
+        Tier(const Partitions &partitions, size_t start_at) :
+            segment(partitions), block(partitions.block), start(start_at),
+            input(slots * block * 2), output(slots * block * 2) {}
+
+        // forgets posted blocks the worker has finished, which a silent
+        // block posted after one may since have taken the slot of
+        void settle() {
+            size_t kept = 0;
+            for (size_t i = 0; i < waiting; i++) {
+                auto tag = holds[pending[i] % slots].load(std::memory_order_acquire);
+                if (tag == ~0ull || tag < pending[i] + 1) {
+                    pending[kept++] = pending[i];
+                }
+            }
+            waiting = kept;
+        }
+
+        // whether a posted block not yet done shares the slot of index
+        bool busy(uint64_t at) {
+            settle();
+            return std::any_of(pending, pending + waiting, [&](uint64_t p) { return p % slots == at % slots; });
+        }
+    };
+    struct Job {
+        Tier *tier;
+        uint64_t index;
+        bool silent;
+    };
+
+    std::shared_ptr<const ImpulseResponse> ir;
+    std::vector<std::unique_ptr<Tier>> tiers;
+    std::vector<float> head_in;
+    std::vector<float> head_out;
+    std::vector<float> zeros;
+    uint64_t frame = 0;
+    std::atomic<uint64_t> late = 0;
+
+    // single producer (the render thread), single consumer (the worker)
+    Job queue[queue_size];
+    std::atomic<uint64_t> head = 0;
+    std::atomic<uint64_t> tail = 0;
+    // bumped on every post and on quit, for the worker to wait on
+    std::atomic<uint32_t> wake = 0;
+    std::atomic<bool> quit = false;
+    std::thread worker;
+
+    explicit Convolver(std::shared_ptr<const ImpulseResponse> impulse) :
+        ir(std::move(impulse)),
+        head_in(ImpulseResponse::blocks[0] * 2), head_out(ImpulseResponse::blocks[0] * 2),
+        zeros(ImpulseResponse::blocks[ImpulseResponse::tiers - 1] * 2) {
+        for (size_t t = 0; t < ir->parts.size(); t++) {
+            tiers.push_back(std::make_unique<Tier>(*ir->parts[t], ImpulseResponse::starts[t]));
+        }
+        if (tiers.size() > 1) {
+            worker = std::thread([this]() { work(); });
+        }
+    }
+
+    ~Convolver() {
+        quit = true;
+        wake.fetch_add(1);
+        wake.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    uint64_t latency() const {
+        return ImpulseResponse::blocks[0];
+    }
+
+    void work() {
+        while (!quit) {
+            auto seen = wake.load();
+            auto at = head.load(std::memory_order_relaxed);
+            if (at == tail.load(std::memory_order_acquire)) {
+                wake.wait(seen);
+                continue;
+            }
+            auto job = queue[at % queue_size];
+            auto &tier = *job.tier;
+            auto slot = job.index % slots;
+            auto &holds = tier.holds[slot];
+            holds.store(~0ull, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            auto in = job.silent ? zeros.data() : tier.input.data() + slot * tier.block * 2;
+            tier.segment.push(in, tier.output.data() + slot * tier.block * 2);
+            holds.store(job.index + 1, std::memory_order_release);
+            holds.notify_all();
+            head.store(at + 1, std::memory_order_release);
+        }
+    }
+
+    // false if the queue is full
+    bool post(Tier &tier, bool silent) {
+        auto at = tail.load(std::memory_order_relaxed);
+        if (at - head.load(std::memory_order_acquire) == queue_size) {
+            return false;
+        }
+        queue[at % queue_size] = {&tier, tier.index, silent};
+        if (!silent) {
+            tier.pending[tier.waiting++] = tier.index;
+        }
+        tail.store(at + 1, std::memory_order_release);
+        wake.fetch_add(1, std::memory_order_release);
+        wake.notify_one();
+        return true;
+    }
+
+    // waits for the worker to finish what it has
+    void drain() {
+        for (auto at = tail.load(); head.load(std::memory_order_acquire) != at; ) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Waits for the worker to finish what it has, then starts from silence.
+    void clear() {
+        drain();
+        for (auto &tier : tiers) {
+            tier->segment.clear();
+            tier->filled = 0;
+            tier->index = 0;
+            tier->dropping = false;
+            tier->waiting = 0;
+            for (auto &holds : tier->holds) {
+                holds.store(0, std::memory_order_relaxed);
+            }
+        }
+        std::fill(head_in.begin(), head_in.end(), 0.0f);
+        std::fill(head_out.begin(), head_out.end(), 0.0f);
+        frame = 0;
+    }
+
+    void process(float *data, size_t count, float mix, bool wait) {
+        auto head_block = ImpulseResponse::blocks[0];
+        for (size_t done = 0; done < count; ) {
+            auto at = frame % head_block;
+            auto n = std::min(count - done, head_block - at);
+            auto io = data + done * 2;
+            std::copy(io, io + n * 2, head_in.begin() + at * 2);
+
+            float wet[ImpulseResponse::blocks[0] * 2];
+            std::copy(head_out.begin() + at * 2, head_out.begin() + (at + n) * 2, wet);
+            for (size_t t = 1; t < tiers.size(); t++) {
+                auto &tier = *tiers[t];
+                // a block starts where the worker may still be reading
+                if (tier.filled == 0) {
+                    while (wait && tier.busy(tier.index)) {
+                        std::this_thread::yield();
+                    }
+                    tier.dropping = !wait && tier.busy(tier.index);
+                    late += tier.dropping;
+                }
+                if (!tier.dropping) {
+                    std::copy(io, io + n * 2, tier.input.begin() + (tier.index % slots * tier.block + tier.filled) * 2);
+                }
+                tier.filled += n;
+                if (tier.filled == tier.block) {
+                    while (!post(tier, tier.dropping)) {
+                        if (!wait) {
+                            late++;
+                            break;
+                        }
+                        std::this_thread::yield();
+                    }
+                    tier.filled = 0;
+                    tier.index++;
+                }
+                if (frame < head_block + tier.start) {
+                    continue;
+                }
+                add(tier, frame - head_block - tier.start, n, wait, wet);
+            }
+            for (size_t i = 0; i < n * 2; i++) {
+                io[i] += wet[i] * mix;
+            }
+            frame += n;
+            done += n;
+            if (frame % head_block == 0) {
+                tiers[0]->segment.push(head_in.data(), head_out.data());
+            }
+        }
+    }
+
+    // adds n frames of tier's output from t0 on to wet, if they are there
+    void add(Tier &tier, uint64_t t0, size_t n, bool wait, float *wet) {
+        auto index = t0 / tier.block;
+        auto &holds = tier.holds[index % slots];
+        auto tag = holds.load(std::memory_order_acquire);
+        if (tag != index + 1) {
+            if (!wait) {
+                late++;
+                return;
+            }
+            while ((tag = holds.load(std::memory_order_acquire)) != index + 1) {
+                holds.wait(tag);
+            }
+        }
+        auto from = tier.output.data() + (index % slots * tier.block + t0 % tier.block) * 2;
+        float out[ImpulseResponse::blocks[0] * 2];
+        std::copy(from, from + n * 2, out);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (holds.load(std::memory_order_relaxed) != tag) {
+            late++;
+            return;
+        }
+        for (size_t i = 0; i < n * 2; i++) {
+            wet[i] += out[i];
+        }
+    }
+};
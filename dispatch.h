@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstring>
+
+// The instruction sets the DSP is compiled for. Default is what the build
+// targets (SSE2 on x86-64, NEON on arm64) and what the synth runs on;
+// scalar is the same code with the vectoriser off, for comparison.
+enum class Isa {
+    Scalar,
+    Default,
+};
+
+inline const char *isa_name(Isa isa) {
+    switch (isa) {
+    case Isa::Scalar:
+        return "scalar";
+    case Isa::Default:
+#if defined(__x86_64__) || defined(__i386__)
+        return "sse2";
+#elif defined(__aarch64__)
+        return "neon";
+#else
+        return "default";
+#endif
+    }
+    return "unknown";
+}
+
+// by name as isa_name gives it, false if the name isn't one
+inline bool parse_isa(const char *name, Isa &to) {
+    for (auto isa : {Isa::Scalar, Isa::Default}) {
+        if (strcmp(name, isa_name(isa)) == 0) {
+            to = isa;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The DSP is header templates, so rather than a kernel per path kept by
+// hand each entry point below is f with everything it calls inlined
+// (flatten), the scalar one with the vectoriser off. Only the entry point
+// differs, so the same patch renders the same way on a path whatever calls
+// it (a seek, the loop cache). Across paths a seek or a cached loop is only
+// as close as the paths are, so the loop cache keys on the path. Clang has
+// no per function switch for the vectoriser, so there the scalar path is
+// the default one.
+//
+// There are no AVX2 or AVX-512 paths: built this way they ran no faster
+// than SSE2 on the whole synth, and FMA put a unison saw 68 LSB off.
+#if defined(__GNUC__) && !defined(__clang__)
+#define DSP_SCALAR __attribute__((flatten, optimize("no-tree-vectorize", "no-tree-slp-vectorize")))
+#else
+#define DSP_SCALAR __attribute__((flatten))
+#endif
+
+template <typename F>
+DSP_SCALAR void run_scalar(F &f) {
+    f();
+}
+
+template <typename F>
+__attribute__((flatten)) void run_default(F &f) {
+    f();
+}
+
+// runs f on the given path
+template <typename F>
+void run_on(Isa isa, F &&f) {
+    switch (isa) {
+    case Isa::Scalar:
+        run_scalar(f);
+        return;
+    default:
+        run_default(f);
+        return;
+    }
+}
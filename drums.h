@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "fastmath.h"
+#include "noise.h"
+
+// Bits of a step's drum mask. A closed hat chokes an open one.
+struct DrumHit {
+    static constexpr uint8_t kick = 1;
+    static constexpr uint8_t snare = 2;
+    static constexpr uint8_t closed_hat = 4;
+    static constexpr uint8_t open_hat = 8;
+};
+
+// What the kit plays on each step of the pattern and how it sounds. The
+// kick sweeps down from kick_sweep octaves above kick_hz; decays are the
+// seconds a hit takes to fall 60dB.
+struct DrumShape {
+    uint8_t steps[8] = {};
+    float level = 0.5f;
+    float kick_hz = 48;
+    float kick_sweep = 2.5f;
+    float kick_decay = 0.6f;
+    float snare_decay = 0.3f;
+    float hat_decay = 0.08f;
+    float open_decay = 0.5f;
+    bool operator==(const DrumShape &) const = default;
+
+    // hats on every step, an open one to end on, three kicks and a snare
+    static DrumShape groove() {
+        auto shape = DrumShape();
+        uint8_t steps[8] = {
+            DrumHit::kick | DrumHit::closed_hat, DrumHit::closed_hat,
+            DrumHit::closed_hat, DrumHit::kick | DrumHit::closed_hat,
+            DrumHit::snare | DrumHit::closed_hat, DrumHit::closed_hat,
+            DrumHit::kick | DrumHit::closed_hat, DrumHit::open_hat,
+        };
+        std::copy(steps, steps + 8, shape.steps);
+        return shape;
+    }
+};
+
+// Three drum voices, each a sine or noise or both under a decaying
+// amplitude, mixed into interleaved stereo. A voice costs nothing once it
+// has decayed below half a bit. Nothing carries from one sample to the
+// next: the decays and the kick's sweep are read from curves of their
+// powers, the kick's phase is the sweep's sum in closed form, the snare's
+// fixed pitch is turned on from the block's start by a table, and the
+// noise is brightened by differencing it with its neighbours, which the
+// counter hash gives directly. So every loop vectorises, running over
+// whole groups of samples into a mono block that is then added to the
+// output. Noise is seeded by the hit's step in the pattern, so every pass
+// of the pattern (and so a seek or the loop cache) hears the same noise.
+struct DrumKit {
+    static constexpr float silence = 0.5f / SHRT_MAX;
+    static constexpr size_t block = 256;
+    static constexpr size_t group = 8;
+    // offsets into a group as floats, converting a size_t doesn't vectorise
+    static constexpr float ramp[group] = {0, 1, 2, 3, 4, 5, 6, 7};
+    static constexpr float snare_hz = 185;
+    static constexpr float sweep_time = 0.03f;
+
+    // fall^i for i up to block, and sum is the sum of the ones before i
+    struct Curve {
+        float fall = 0;
+        float power[block + 1];
+        float sum[block + 1];
+
+        void set(float per_sample) {
+            if (per_sample == fall) {
+                return;
+            }
+            fall = per_sample;
+            double p = 1, total = 0;
+            for (size_t i = 0; i <= block; i++) {
+                power[i] = static_cast<float>(p);
+                sum[i] = static_cast<float>(total);
+                total += p;
+                p *= per_sample;
+            }
+        }
+    };
+
+    struct Voice {
+        bool active = false;
+        float amp = 0;
+        const Curve *curve = nullptr;
+        uint32_t seed = 0;
+        uint32_t age = 0;
+        float phase = 0;
+        float sweep = 0;
+        float body = 0;
+    };
+
+    float rate;
+    DrumShape shape;
+    Curve kick_curve;
+    Curve snare_curve;
+    Curve hat_curve;
+    Curve open_curve;
+    Curve sweep_curve;
+    // the snare body's sine and cosine i samples on from phase 0
+    float body_sin[block];
+    float body_cos[block];
+    Voice kick;
+    Voice snare;
+    Voice hat;
+    float noise[block + 4];
+    float mono[block];
+
+    explicit DrumKit(float rate_hz) :
+        rate(rate_hz) {
+        set_shape(shape);
+        sweep_curve.set(std::exp(-1.0f / (sweep_time * rate)));
+        for (size_t i = 0; i < block; i++) {
+            body_sin[i] = static_cast<float>(std::sin(2 * M_PI * snare_hz * i / rate));
+            body_cos[i] = static_cast<float>(std::cos(2 * M_PI * snare_hz * i / rate));
+        }
+    }
+
+    void set_shape(const DrumShape &new_shape) {
+        shape = new_shape;
+        kick_curve.set(fall(shape.kick_decay));
+        snare_curve.set(fall(shape.snare_decay));
+        hat_curve.set(fall(shape.hat_decay));
+        open_curve.set(fall(shape.open_decay));
+    }
+
+    bool active() const {
+        return kick.active || snare.active || hat.active;
+    }
+
+    void clear() {
+        kick = {};
+        snare = {};
+        hat = {};
+    }
+
+    // per sample gain falling 60dB over seconds
+    float fall(float seconds) const {
+        return std::pow(1e-3f, 1.0f / std::max(seconds * rate, 1.0f));
+    }
+
+    // samples the longest hit rings for before it is below half a bit
+    uint64_t tail_length() const {
+        if (std::none_of(shape.steps, shape.steps + 8, [](uint8_t s) { return s; })) {
+            return 0;
+        }
+        auto longest = std::max({shape.kick_decay, shape.snare_decay, shape.hat_decay, shape.open_decay});
+        auto drop = std::log(std::max(shape.level, silence) / silence) / std::log(1e3f);
+        return static_cast<uint64_t>(longest * drop * rate) + 1;
+    }
+
+    // step is the hit's step in the pattern, velocity scales the hit
+    void hit(uint8_t drums, uint64_t step, float velocity) {
+        auto start = [&](Voice &voice, uint32_t which, const Curve &curve) {
+            voice = {};
+            voice.active = true;
+            voice.amp = velocity * shape.level;
+            voice.curve = &curve;
+            voice.seed = noise_hash(static_cast<uint32_t>(step * 4 + which));
+            voice.sweep = 1;
+            voice.body = 1;
+        };
+        if (drums & DrumHit::kick) {
+            start(kick, 0, kick_curve);
+        }
+        if (drums & DrumHit::snare) {
+            start(snare, 1, snare_curve);
+        }
+        if (drums & DrumHit::closed_hat) {
+            start(hat, 2, hat_curve);
+        } else if (drums & DrumHit::open_hat) {
+            start(hat, 3, open_curve);
+        }
+    }
+
+    // adds count frames of the kit to data
+    void render(float *data, size_t count) {
+        for (size_t begin = 0; begin < count; begin += block) {
+            auto n = std::min(count - begin, block);
+            auto groups = (n + group - 1) / group;
+            std::fill(mono, mono + groups * group, 0.0f);
+            if (kick.active) {
+                render_kick(n, groups);
+            }
+            if (snare.active) {
+                render_snare(n, groups);
+            }
+            if (hat.active) {
+                render_hat(n, groups);
+            }
+            auto frames = data + begin * 2;
+            for (size_t i = 0; i < n; i++) {
+                frames[i * 2] += mono[i];
+                frames[i * 2 + 1] += mono[i];
+            }
+        }
+    }
+
+    void finish(Voice &voice, size_t count) {
+        voice.amp *= voice.curve->power[count];
+        voice.age += static_cast<uint32_t>(count);
+        voice.active = voice.amp >= silence;
+    }
+
+    // truncating a positive number floors it without a call to floor
+    static float wrap(float cycles) {
+        return cycles - static_cast<float>(static_cast<int32_t>(cycles));
+    }
+
+    // a sine falling from kick_sweep octaves up to kick_hz, the excess
+    // decaying over sweep_time
+    void render_kick(size_t count, size_t groups) {
+        auto &v = kick;
+        auto base = shape.kick_hz / rate;
+        auto extra = base * (std::exp2(shape.kick_sweep) - 1) * v.sweep;
+        auto phase = v.phase;
+        auto amp = v.amp;
+        for (size_t g = 0; g < groups * group; g += group) {
+            const float *sum = sweep_curve.sum + g;
+            const float *power = v.curve->power + g;
+            auto at = phase + base * g;
+            float out[group];
+            for (size_t i = 0; i < group; i++) {
+                auto cycles = at + base * ramp[i] + extra * sum[i];
+                out[i] = fast_sine(wrap(cycles)) * amp * power[i];
+            }
+            add(out, g);
+        }
+        v.phase = wrap(phase + base * count + extra * sweep_curve.sum[count]);
+        v.sweep *= sweep_curve.power[count];
+        finish(v, count);
+    }
+
+    void add(const float *out, size_t at) {
+        for (size_t i = 0; i < group; i++) {
+            mono[at + i] += out[i];
+        }
+    }
+
+    // noise and its neighbours from age - 2 on, for the differences: two
+    // 16 bit samples to each hash, halving the hashing, age a being half
+    // a % 2 of the hash of a / 2 (counted modulo 2^31 as age wraps)
+    const float *neighbours(const Voice &v, size_t groups) {
+        auto from = v.age - 2;
+        auto first = from >> 1;
+        auto pairs = (groups * group + 3 + (from & 1)) / 2;
+        for (size_t g = 0; g < pairs; g += group) {
+            float values[2 * group];
+            for (size_t i = 0; i < group; i++) {
+                auto bits = noise_hash(v.seed + ((first + static_cast<uint32_t>(g + i)) & 0x7fffffffu));
+                values[2 * i] = static_cast<int16_t>(bits) * (1.0f / 32768);
+                values[2 * i + 1] = static_cast<int16_t>(bits >> 16) * (1.0f / 32768);
+            }
+            std::copy(values, values + 2 * std::min(group, pairs - g), noise + 2 * g);
+        }
+        return noise + (from & 1) + 2;
+    }
+
+    // a sine body fading twice as fast under noise with the lows taken
+    // off by a first difference; the body's pitch is fixed, so it is the
+    // sine at the block's start turned by the tables
+    void render_snare(size_t count, size_t groups) {
+        auto &v = snare;
+        auto x = neighbours(v, groups);
+        auto sine = fast_sine(v.phase) * v.body * 0.5f;
+        auto cosine = fast_sine(wrap(v.phase + 0.25f)) * v.body * 0.5f;
+        auto amp = v.amp;
+        for (size_t g = 0; g < groups * group; g += group) {
+            const float *power = v.curve->power + g;
+            const float *in = x + g;
+            const float *turn_sin = body_sin + g;
+            const float *turn_cos = body_cos + g;
+            float out[group];
+            for (size_t i = 0; i < group; i++) {
+                auto fade = power[i];
+                auto tone = (sine * turn_cos[i] + cosine * turn_sin[i]) * fade;
+                out[i] = ((in[i] - in[i - 1]) * 0.4f + tone) * amp * fade;
+            }
+            add(out, g);
+        }
+        v.phase = wrap(v.phase + snare_hz / rate * count);
+        v.body *= v.curve->power[count];
+        finish(v, count);
+    }
+
+    // noise through a second difference, rising 12dB an octave
+    void render_hat(size_t count, size_t groups) {
+        auto &v = hat;
+        auto x = neighbours(v, groups);
+        auto amp = v.amp * 0.3f;
+        for (size_t g = 0; g < groups * group; g += group) {
+            const float *power = v.curve->power + g;
+            const float *in = x + g;
+            float out[group];
+            for (size_t i = 0; i < group; i++) {
+                out[i] = (in[i] - 2 * in[i - 1] + in[i - 2]) * amp * power[i];
+            }
+            add(out, g);
+        }
+        finish(v, count);
+    }
+};
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "fastmath.h"
+
+// Above threshold dBFS the RMS level rises only 1 dB per ratio dB of input;
+// ratio 1 is off. window is the RMS averaging time and attack and release
+// how fast the gain follows, in seconds; makeup dB is added after.
+struct CompressorShape {
+    float threshold = -18;
+    float ratio = 1;
+    float window = 0.01f;
+    float attack = 0.005f;
+    float release = 0.15f;
+    float makeup = 0;
+    bool operator==(const CompressorShape &) const = default;
+};
+
+// Peaks never pass ceiling dBFS: the gain comes down over the lookahead
+// seconds before a peak reaches the output and recovers over release.
+struct LimiterShape {
+    static constexpr float longest = 0.01f;
+    bool on = true;
+    float ceiling = -0.3f;
+    float lookahead = 0.002f;
+    float release = 0.05f;
+    bool operator==(const LimiterShape &) const = default;
+};
+
+struct DynamicsShape {
+    CompressorShape compressor;
+    LimiterShape limiter;
+    bool operator==(const DynamicsShape &) const = default;
+};
+
+// The largest of the last window values pushed in O(1) amortised: a
+// monotonic deque holds only the values that can still become the largest,
+// decreasing from the front, in a ring a power of two long.
+struct SlidingMax {
+    std::vector<float> values;
+    std::vector<uint64_t> times;
+    size_t mask;
+    size_t front = 0;
+    size_t back = 0;
+    uint64_t now = 0;
+
+    explicit SlidingMax(size_t longest) :
+        values(std::bit_ceil(longest + 2)), times(values.size()), mask(values.size() - 1) {}
+
+    float push(float x, size_t window) {
+        while (back != front && values[(back - 1) & mask] <= x) {
+            back--;
+        }
+        values[back & mask] = x;
+        times[back & mask] = now;
+        back++;
+        while (times[front & mask] + window <= now) {
+            front++;
+        }
+        now++;
+        return values[front & mask];
+    }
+
+    void clear() {
+        front = 0;
+        back = 0;
+        now = 0;
+    }
+};
+
+// The master bus: an RMS compressor then a lookahead limiter over
+// interleaved stereo, so the mix can be driven hard without clipping.
+struct Dynamics {
+    static constexpr float silence = 0.5f / SHRT_MAX;
+    float rate;
+    DynamicsShape shape;
+
+    // compressor: mean square and gain, both in log2
+    float mean_square = 0;
+    float gain_log2 = 0;
+
+    // limiter: the input delayed by lookahead - 1 frames, the envelope
+    // before and after a box filter lookahead long, the box's running sum;
+    // head is the slot in both rings the next frame goes in
+    SlidingMax peaks;
+    std::vector<float> delayed;
+    std::vector<float> boxed;
+    size_t head = 0;
+    float envelope = 1;
+    double box_sum = 0;
+
+    uint64_t quiet = 0;
+    bool cleared = true;
+    std::atomic<float> lowest_gain = 1;
+
+    explicit Dynamics(float rate_hz) :
+        rate(rate_hz), peaks(LimiterShape::longest * rate_hz),
+        delayed(2 * static_cast<size_t>(LimiterShape::longest * rate_hz + 1)),
+        boxed(static_cast<size_t>(LimiterShape::longest * rate_hz + 1)) {
+        clear();
+    }
+
+    // the limiter's latency and box length, in frames
+    size_t lookahead() const {
+        return std::clamp<size_t>(shape.limiter.lookahead * rate, 1, boxed.size());
+    }
+
+    void set_shape(const DynamicsShape &new_shape) {
+        auto resize = new_shape.limiter.lookahead != shape.limiter.lookahead;
+        shape = new_shape;
+        if (resize) {
+            clear();
+        }
+    }
+
+    void clear() {
+        mean_square = 0;
+        gain_log2 = 0;
+        peaks.clear();
+        std::fill(delayed.begin(), delayed.end(), 0.0f);
+        std::fill(boxed.begin(), boxed.end(), 1.0f);
+        head = 0;
+        envelope = 1;
+        box_sum = lookahead();
+        quiet = 0;
+        cleared = true;
+    }
+
+    // samples until the state no longer remembers the input, to 0.1%
+    uint64_t settle_length() const {
+        auto settle = [&](float seconds) {
+            return static_cast<uint64_t>(std::log(1e3f) * seconds * rate) + 1;
+        };
+        uint64_t length = 0;
+        if (shape.compressor.ratio != 1) {
+            length += settle(shape.compressor.window) + settle(shape.compressor.release);
+        }
+        if (shape.limiter.on) {
+            length += lookahead() + settle(shape.limiter.release);
+        }
+        return length;
+    }
+
+    static float peak_of(const float *data, size_t count) {
+        auto peak = 0.0f;
+        for (size_t i = 0; i < count * 2; i++) {
+            peak = std::max(peak, std::abs(data[i]));
+        }
+        return peak;
+    }
+
+    static float follow(float seconds, float rate) {
+        return 1.0f - std::exp(-1.0f / std::max(seconds * rate, 1.0f));
+    }
+
+    void compress(float *data, size_t count) {
+        auto &c = shape.compressor;
+        auto window = follow(c.window, rate);
+        auto attack = follow(c.attack, rate);
+        auto release = follow(c.release, rate);
+        // dB to log2 of amplitude
+        auto threshold = c.threshold / 6.0206f;
+        auto makeup = c.makeup / 6.0206f;
+        auto slope = 1.0f / std::max(c.ratio, 1.0f) - 1.0f;
+        for (size_t i = 0; i < count; i++) {
+            auto l = data[i * 2];
+            auto r = data[i * 2 + 1];
+            mean_square += (0.5f * (l * l + r * r) - mean_square) * window;
+            auto over = 0.5f * fast_log2(mean_square) - threshold;
+            auto want = over > 0 ? over * slope : 0.0f;
+            gain_log2 += (want - gain_log2) * (want < gain_log2 ? attack : release);
+            auto gain = fast_exp2(gain_log2 + makeup);
+            data[i * 2] = l * gain;
+            data[i * 2 + 1] = r * gain;
+        }
+    }
+
+    // A peak's gain holds for the lookahead frames after it arrives, and
+    // the box filter over those frames brings the gain down to it by the
+    // time the peak, delayed lookahead - 1 frames, is written out.
+    void limit(float *data, size_t count) {
+        auto length = lookahead();
+        auto ceiling = fast_exp2(shape.limiter.ceiling / 6.0206f);
+        // the release heads for 1 and is held under the target, one fma and
+        // a min in the chain from frame to frame; nudged up a little so
+        // it gets all the way to 1 rather than stalling a few ulps short
+        auto release = follow(shape.limiter.release, rate);
+        auto keep = 1 - release;
+        auto rise = release + 1e-6f;
+        // with the gain all the way back and nothing over the ceiling in
+        // the window or the block, the limiter is only a delay; what the
+        // sliding max holds is under the ceiling and can't matter
+        if (envelope == 1 && box_sum == length && peak_of(data, count) <= ceiling) {
+            peaks.clear();
+            for (size_t i = 0; i < count; i++) {
+                auto l = data[i * 2];
+                auto r = data[i * 2 + 1];
+                delayed[head * 2] = l;
+                delayed[head * 2 + 1] = r;
+                head = head + 1 == length ? 0 : head + 1;
+                data[i * 2] = delayed[head * 2];
+                data[i * 2 + 1] = delayed[head * 2 + 1];
+            }
+            return;
+        }
+        auto scale = 1.0 / length;
+        auto lowest = 1.0f;
+        for (size_t i = 0; i < count; i++) {
+            auto l = data[i * 2];
+            auto r = data[i * 2 + 1];
+            auto peak = peaks.push(std::max(std::abs(l), std::abs(r)), length);
+            auto target = peak > ceiling ? ceiling / peak : 1.0f;
+            envelope = std::min(target, envelope * keep + rise);
+            box_sum += envelope - boxed[head];
+            boxed[head] = envelope;
+            auto gain = static_cast<float>(box_sum * scale);
+            lowest = std::min(lowest, gain);
+            delayed[head * 2] = l;
+            delayed[head * 2 + 1] = r;
+            head = head + 1 == length ? 0 : head + 1;
+            data[i * 2] = delayed[head * 2] * gain;
+            data[i * 2 + 1] = delayed[head * 2 + 1] * gain;
+        }
+        if (lowest < lowest_gain.load(std::memory_order_relaxed)) {
+            lowest_gain.store(lowest, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns 1 if the block was skipped: once the input has been silent
+    // for longer than the state remembers, the state is reset and left be.
+    size_t process(float *data, size_t count) {
+        auto compressing = shape.compressor.ratio != 1;
+        if (!compressing && !shape.limiter.on) {
+            return 0;
+        }
+        quiet = peak_of(data, count) < silence ? quiet + count : 0;
+        if (quiet > settle_length() + count) {
+            if (!cleared) {
+                auto silent = quiet;
+                clear();
+                quiet = silent;
+            }
+            return 1;
+        }
+        cleared = false;
+        if (compressing) {
+            compress(data, count);
+        }
+        if (shape.limiter.on) {
+            limit(data, count);
+        }
+        return 0;
+    }
+};
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "convolution.h"
+#include "fm.h"
+
+// A delay line a power of two long, so the write position just counts up
+// and every read masks it: no wrap test and no cost that grows with the
+// delay. Reads interpolate linearly between samples.
+struct DelayLine {
+    std::vector<float> samples;
+    size_t mask = 0;
+    size_t head = 0;
+
+    // room for delays up to longest samples
+    explicit DelayLine(size_t longest) :
+        samples(std::bit_ceil(longest + 2)), mask(samples.size() - 1) {}
+
+    void push(float x) {
+        samples[head++ & mask] = x;
+    }
+
+    // what was pushed delay samples before the next push, delay >= 1
+    float tap(float delay) const {
+        auto whole = static_cast<size_t>(delay);
+        auto fraction = delay - whole;
+        auto a = samples[(head - whole) & mask];
+        auto b = samples[(head - whole - 1) & mask];
+        return a + (b - a) * fraction;
+    }
+
+    void clear() {
+        std::fill(samples.begin(), samples.end(), 0.0f);
+    }
+};
+
+// Echoes left and right seconds late, each fed back into its own line.
+struct EchoShape {
+    static constexpr float longest = 2;
+    float left = 0.375f;
+    float right = 0.5f;
+    float feedback = 0.35f;
+    float mix = 0;
+    bool operator==(const EchoShape &) const = default;
+};
+
+// A delay swept by a sine around delay seconds, depth either way, the
+// right channel a quarter cycle behind the left.
+struct SweepShape {
+    static constexpr float longest = 0.05f;
+    float delay = 0.015f;
+    float depth = 0.003f;
+    float rate = 0.8f;
+    float feedback = 0;
+    float mix = 0;
+
+    static SweepShape chorus(float mix) {
+        return {0.015f, 0.003f, 0.8f, 0, mix};
+    }
+
+    static SweepShape flanger(float mix) {
+        return {0.0025f, 0.002f, 0.2f, 0.6f, mix};
+    }
+
+    bool operator==(const SweepShape &) const = default;
+};
+
+// A room: time seconds to fall 60 dB, size scaling its delays, damping
+// how much of the top each pass loses, after predelay seconds.
+struct ReverbShape {
+    static constexpr float longest_predelay = 0.1f;
+    static constexpr float largest = 2;
+    float time = 2;
+    float size = 1;
+    float damping = 0.3f;
+    float predelay = 0.01f;
+    float mix = 0;
+    bool operator==(const ReverbShape &) const = default;
+};
+
+// The patch's impulse response, mix of it added.
+struct ConvolutionShape {
+    float mix = 0;
+    bool operator==(const ConvolutionShape &) const = default;
+};
+
+// Run in this order; an effect with no mix is off.
+struct EffectsShape {
+    SweepShape chorus = SweepShape::chorus(0);
+    SweepShape flanger = SweepShape::flanger(0);
+    EchoShape echo;
+    ConvolutionShape convolution;
+    ReverbShape reverb;
+    bool operator==(const EffectsShape &) const = default;
+};
+
+// Samples until a loop of gain feedback every period has died away.
+inline uint64_t ring_length(float period, float feedback, float rate) {
+    auto repeats = feedback > 0 ? std::ceil(std::log(0.5f / SHRT_MAX) / std::log(std::min(feedback, 0.99f))) : 0;
+    return static_cast<uint64_t>(period * rate * (repeats + 1)) + 1;
+}
+
+// Stereo effects on interleaved blocks. Sweeps take their phase from the
+// clock so they sound the same however the blocks fall. Each effect sleeps
+// once its input has been silent for longer than it rings.
+struct Effects {
+    static constexpr float silence = 0.5f / SHRT_MAX;
+
+    struct Quiet {
+        uint64_t quiet = 0;
+
+        // whether the block can be skipped, input being silent
+        bool idle(const float *data, size_t count, uint64_t tail) {
+            auto peak = 0.0f;
+            for (size_t i = 0; i < count * 2; i++) {
+                peak = std::max(peak, std::abs(data[i]));
+            }
+            quiet = peak < silence ? quiet + count : 0;
+            return quiet > tail + count;
+        }
+    };
+
+    struct Stage : Quiet {
+        float rate;
+        DelayLine left;
+        DelayLine right;
+
+        Stage(float rate_hz, float longest) :
+            rate(rate_hz), left(longest * rate_hz), right(longest * rate_hz) {}
+
+        void clear() {
+            left.clear();
+            right.clear();
+            quiet = 0;
+        }
+    };
+
+    struct Echo : Stage {
+        explicit Echo(float rate_hz) : Stage(rate_hz, EchoShape::longest) {}
+
+        void process(const EchoShape &shape, float *data, size_t count) {
+            auto l = std::clamp(shape.left * rate, 1.0f, EchoShape::longest * rate);
+            auto r = std::clamp(shape.right * rate, 1.0f, EchoShape::longest * rate);
+            for (size_t i = 0; i < count; i++) {
+                auto x = data[i * 2];
+                auto y = data[i * 2 + 1];
+                auto a = left.tap(l);
+                auto b = right.tap(r);
+                left.push(x + a * shape.feedback);
+                right.push(y + b * shape.feedback);
+                data[i * 2] = x + a * shape.mix;
+                data[i * 2 + 1] = y + b * shape.mix;
+            }
+        }
+
+        uint64_t tail(const EchoShape &shape) const {
+            return ring_length(std::max(shape.left, shape.right), shape.feedback, rate);
+        }
+    };
+
+    struct Sweep : Stage {
+        explicit Sweep(float rate_hz) : Stage(rate_hz, SweepShape::longest) {}
+
+        void process(const SweepShape &shape, float *data, size_t count, uint64_t time) {
+            auto cycles = static_cast<double>(time) * shape.rate / rate;
+            auto phase = static_cast<uint32_t>((cycles - std::floor(cycles)) * 4294967296.0);
+            auto step = static_cast<uint32_t>(shape.rate / rate * 4294967296.0);
+            auto centre = shape.delay * rate;
+            auto depth = shape.depth * rate;
+            auto low = 1.0f;
+            auto high = SweepShape::longest * rate - 1;
+            for (size_t i = 0; i < count; i++) {
+                auto x = data[i * 2];
+                auto y = data[i * 2 + 1];
+                auto a = left.tap(std::clamp(centre + depth * sine_table(phase), low, high));
+                auto b = right.tap(std::clamp(centre + depth * sine_table(phase - (1u << 30)), low, high));
+                left.push(x + a * shape.feedback);
+                right.push(y + b * shape.feedback);
+                data[i * 2] = x + a * shape.mix;
+                data[i * 2 + 1] = y + b * shape.mix;
+                phase += step;
+            }
+        }
+
+        uint64_t tail(const SweepShape &shape) const {
+            return ring_length(shape.delay + shape.depth, shape.feedback, rate);
+        }
+    };
+
+    // A feedback delay network of eight lines stored interleaved, so each
+    // frame's damping, decay, Householder feedback and write are all eight
+    // wide. Left feeds the even lines and right the odd; the stage's own
+    // lines are the predelay.
+    struct Reverb : Stage {
+        static constexpr size_t lines = 8;
+        static constexpr float spacing[lines] = {
+            0.0297f, 0.0371f, 0.0411f, 0.0437f, 0.0533f, 0.0599f, 0.0677f, 0.0731f,
+        };
+        std::vector<float> network;
+        size_t mask;
+        size_t head = 0;
+        float low[lines] = {};
+
+        explicit Reverb(float rate_hz) :
+            Stage(rate_hz, ReverbShape::longest_predelay),
+            network(std::bit_ceil(static_cast<size_t>(spacing[lines - 1] * ReverbShape::largest * rate_hz) + 1) * lines),
+            mask(network.size() / lines - 1) {}
+
+        // summed as a tree so the halves add as vectors
+        static float total(const float *x) {
+            float half[lines / 2];
+            for (size_t l = 0; l < lines / 2; l++) {
+                half[l] = x[l] + x[l + lines / 2];
+            }
+            return (half[0] + half[2]) + (half[1] + half[3]);
+        }
+
+        void clear() {
+            Stage::clear();
+            std::fill(network.begin(), network.end(), 0.0f);
+            std::fill(std::begin(low), std::end(low), 0.0f);
+        }
+
+        size_t delay(const ReverbShape &shape, size_t line) const {
+            auto size = std::clamp(shape.size, 0.1f, ReverbShape::largest);
+            return std::max<size_t>(1, spacing[line] * size * rate);
+        }
+
+        void process(const ReverbShape &shape, float *data, size_t count) {
+            size_t delays[lines];
+            float gain[lines];
+            for (size_t l = 0; l < lines; l++) {
+                delays[l] = delay(shape, l);
+                gain[l] = std::pow(0.001f, delays[l] / (std::max(shape.time, 0.01f) * rate));
+            }
+            auto keep = std::clamp(shape.damping, 0.0f, 0.99f);
+            auto predelay = std::clamp(shape.predelay * rate, 1.0f, ReverbShape::longest_predelay * rate);
+            constexpr float to_left[lines] = {0.5f, 0, -0.5f, 0, 0.5f, 0, -0.5f, 0};
+            constexpr float to_right[lines] = {0, 0.5f, 0, -0.5f, 0, 0.5f, 0, -0.5f};
+            constexpr float from_left[lines] = {1, 0, 1, 0, 1, 0, 1, 0};
+            float state[lines];
+            std::copy(std::begin(low), std::end(low), state);
+            for (size_t i = 0; i < count; i++) {
+                auto x = left.tap(predelay);
+                auto y = right.tap(predelay);
+                left.push(data[i * 2]);
+                right.push(data[i * 2 + 1]);
+
+                float v[lines];
+                for (size_t l = 0; l < lines; l++) {
+                    v[l] = network[((head - delays[l]) & mask) * lines + l];
+                }
+                float tap_left[lines];
+                float tap_right[lines];
+                for (size_t l = 0; l < lines; l++) {
+                    tap_left[l] = v[l] * to_left[l];
+                    tap_right[l] = v[l] * to_right[l];
+                    state[l] = v[l] * gain[l] * (1 - keep) + state[l] * keep;
+                }
+                auto sum = total(state);
+                auto write = network.data() + (head & mask) * lines;
+                for (size_t l = 0; l < lines; l++) {
+                    write[l] = state[l] - sum * (2.0f / lines) + x * from_left[l] + y * (1 - from_left[l]);
+                }
+                head++;
+                data[i * 2] += total(tap_left) * shape.mix;
+                data[i * 2 + 1] += total(tap_right) * shape.mix;
+            }
+            std::copy(state, state + lines, low);
+        }
+
+        uint64_t tail(const ReverbShape &shape) const {
+            auto fall = std::log(0.5f / SHRT_MAX) / std::log(0.001f);
+            return static_cast<uint64_t>((std::max(shape.time, 0.01f) * fall + shape.predelay) * rate) +
+                delay(shape, lines - 1);
+        }
+    };
+
+    struct Convolution : Quiet {
+        std::unique_ptr<Convolver> convolver;
+        // mixes a late block as silence rather than waiting for it
+        bool realtime = false;
+
+        void set_impulse(std::shared_ptr<const ImpulseResponse> impulse) {
+            if (!impulse) {
+                convolver.reset();
+            } else if (!convolver || convolver->ir != impulse) {
+                convolver = std::make_unique<Convolver>(std::move(impulse));
+            }
+            quiet = 0;
+        }
+
+        void clear() {
+            if (convolver) {
+                convolver->clear();
+            }
+            quiet = 0;
+        }
+
+        uint64_t tail() const {
+            return convolver ? convolver->ir->length + convolver->latency() : 0;
+        }
+    };
+
+    EffectsShape shape;
+    Sweep chorus;
+    Sweep flanger;
+    Echo echo;
+    Convolution convolution;
+    Reverb reverb;
+
+    explicit Effects(float rate) : chorus(rate), flanger(rate), echo(rate), reverb(rate) {}
+
+    // a stage turned back on starts from silence, not from whatever it
+    // held when it was turned off
+    void set_shape(const EffectsShape &new_shape) {
+        if (!shape.chorus.mix && new_shape.chorus.mix) {
+            chorus.clear();
+        }
+        if (!shape.flanger.mix && new_shape.flanger.mix) {
+            flanger.clear();
+        }
+        if (!shape.echo.mix && new_shape.echo.mix) {
+            echo.clear();
+        }
+        if (!shape.convolution.mix && new_shape.convolution.mix) {
+            convolution.clear();
+        }
+        if (!shape.reverb.mix && new_shape.reverb.mix) {
+            reverb.clear();
+        }
+        shape = new_shape;
+    }
+
+    // the impulse response is loaded once and shared, like a patch's banks
+    void set_impulse(std::shared_ptr<const ImpulseResponse> impulse) {
+        convolution.set_impulse(std::move(impulse));
+    }
+
+    void clear() {
+        chorus.clear();
+        flanger.clear();
+        echo.clear();
+        convolution.clear();
+        reverb.clear();
+    }
+
+    // whether the output repeats whenever the input does
+    bool periodic() const {
+        return !shape.chorus.mix && !shape.flanger.mix;
+    }
+
+    // samples after the input stops until the output does
+    uint64_t tail_length() const {
+        uint64_t length = 0;
+        length += shape.chorus.mix ? chorus.tail(shape.chorus) : 0;
+        length += shape.flanger.mix ? flanger.tail(shape.flanger) : 0;
+        length += shape.echo.mix ? echo.tail(shape.echo) : 0;
+        length += shape.convolution.mix ? convolution.tail() : 0;
+        length += shape.reverb.mix ? reverb.tail(shape.reverb) : 0;
+        return length;
+    }
+
+    // Runs the bus over count frames starting at clock position time;
+    // returns how many stages slept through the block.
+    size_t process(float *data, size_t count, uint64_t time) {
+        size_t skipped = 0;
+        if (shape.chorus.mix) {
+            if (chorus.idle(data, count, chorus.tail(shape.chorus))) {
+                skipped++;
+            } else {
+                chorus.process(shape.chorus, data, count, time);
+            }
+        }
+        if (shape.flanger.mix) {
+            if (flanger.idle(data, count, flanger.tail(shape.flanger))) {
+                skipped++;
+            } else {
+                flanger.process(shape.flanger, data, count, time);
+            }
+        }
+        if (shape.echo.mix) {
+            if (echo.idle(data, count, echo.tail(shape.echo))) {
+                skipped++;
+            } else {
+                echo.process(shape.echo, data, count);
+            }
+        }
+        if (shape.convolution.mix && convolution.convolver) {
+            if (convolution.idle(data, count, convolution.tail())) {
+                skipped++;
+            } else {
+                convolution.convolver->process(data, count, shape.convolution.mix, !convolution.realtime);
+            }
+        }
+        if (shape.reverb.mix) {
+            if (reverb.idle(data, count, reverb.tail(shape.reverb))) {
+                skipped++;
+            } else {
+                reverb.process(shape.reverb, data, count);
+            }
+        }
+        return skipped;
+    }
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// A multi-segment envelope. Each segment moves from wherever the envelope
+// is to level in time seconds along an exponential that would overshoot
+// level by overshoot of the distance, which makes every segment exactly
+// time long whatever it starts from. The envelope holds at the end of
+// segment sustain until released, then runs the release segment.
+struct EnvelopeShape {
+    static constexpr size_t max_segments = 8;
+    struct Segment {
+        float level;
+        float time;
+        bool operator==(const Segment &) const = default;
+    };
+    Segment segments[max_segments] = {};
+    size_t count = 0;
+    size_t sustain = 0;
+    Segment release = {0, 0.1f};
+    float overshoot = 0.1f;
+
+    static EnvelopeShape adsr(float attack, float decay, float sustain, float release) {
+        auto shape = EnvelopeShape();
+        shape.segments[0] = {1, attack};
+        shape.segments[1] = {sustain, decay};
+        shape.count = 2;
+        shape.sustain = 1;
+        shape.release = {0, release};
+        return shape;
+    }
+
+    bool operator==(const EnvelopeShape &) const = default;
+};
+
+// Lanes envelopes stepped together into [sample * Lanes + lane] blocks.
+// Within a segment a lane's level is target + distance * rate^n, so a
+// block is split only where some lane reaches the end of its segment and
+// the runs in between are a multiply-add across lanes.
+template <size_t Lanes>
+struct Envelope {
+    static constexpr uint32_t forever = UINT32_MAX;
+    static constexpr uint32_t releasing = EnvelopeShape::max_segments;
+    static constexpr uint32_t idle = releasing + 1;
+
+    float sample_rate;
+    EnvelopeShape shape;
+    float rates[EnvelopeShape::max_segments + 1] = {};
+    uint32_t lengths[EnvelopeShape::max_segments + 1] = {};
+
+    float target[Lanes] = {};
+    float distance[Lanes] = {};
+    float rate[Lanes] = {};
+    uint32_t left[Lanes];
+    uint32_t segment[Lanes];
+
+    Envelope(float rate_hz) :
+        sample_rate(rate_hz) {
+        std::fill(std::begin(left), std::end(left), forever);
+        std::fill(std::begin(segment), std::end(segment), idle);
+        set_shape(EnvelopeShape::adsr(0.005f, 0.2f, 0.7f, 0.15f));
+    }
+
+    void set_shape(const EnvelopeShape &new_shape) {
+        shape = new_shape;
+        auto ratio = shape.overshoot / (1.0f + shape.overshoot);
+        for (size_t i = 0; i <= EnvelopeShape::max_segments; i++) {
+            auto time = i < shape.count ? shape.segments[i].time : shape.release.time;
+            lengths[i] = std::max<uint32_t>(1, static_cast<uint32_t>(time * sample_rate));
+            rates[i] = std::pow(ratio, 1.0f / lengths[i]);
+        }
+    }
+
+    const EnvelopeShape::Segment &segment_of(uint32_t index) const {
+        return index == releasing ? shape.release : shape.segments[index];
+    }
+
+    float level(size_t lane) const {
+        return target[lane] + distance[lane];
+    }
+
+    bool active(size_t lane) const {
+        return segment[lane] != idle;
+    }
+
+    void enter(size_t lane, uint32_t index) {
+        auto from = level(lane);
+        if (index == idle || (index != releasing && index >= shape.count)) {
+            segment[lane] = idle;
+            target[lane] = 0;
+            distance[lane] = 0;
+            rate[lane] = 1;
+            left[lane] = forever;
+            return;
+        }
+        auto to = segment_of(index).level;
+        segment[lane] = index;
+        target[lane] = to + (to - from) * shape.overshoot;
+        distance[lane] = from - target[lane];
+        rate[lane] = rates[index];
+        left[lane] = lengths[index];
+    }
+
+    void hold(size_t lane) {
+        target[lane] = level(lane);
+        distance[lane] = 0;
+        rate[lane] = 1;
+        left[lane] = forever;
+    }
+
+    // called when a lane's segment has run its length
+    void finish(size_t lane) {
+        auto index = segment[lane];
+        auto end = segment_of(index).level;
+        target[lane] = end;
+        distance[lane] = 0;
+        if (index == releasing) {
+            enter(lane, idle);
+        } else if (index == shape.sustain) {
+            hold(lane);
+        } else {
+            enter(lane, index + 1);
+        }
+    }
+
+    void gate_on(size_t lane) {
+        enter(lane, 0);
+    }
+
+    void gate_off(size_t lane) {
+        if (segment[lane] != idle && segment[lane] != releasing) {
+            enter(lane, releasing);
+        }
+    }
+
+    // Moves a lane on by n samples without producing output.
+    void skip(size_t lane, uint64_t n) {
+        while (n && segment[lane] != idle) {
+            if (left[lane] == forever) {
+                return;
+            }
+            auto step = std::min<uint64_t>(n, left[lane]);
+            distance[lane] *= std::pow(rate[lane], static_cast<float>(step));
+            left[lane] -= step;
+            n -= step;
+            if (!left[lane]) {
+                finish(lane);
+            }
+        }
+    }
+
+    void process(float *out, size_t count) {
+        size_t i = 0;
+        while (i < count) {
+            uint32_t run = count - i;
+            for (size_t v = 0; v < Lanes; v++) {
+                run = std::min(run, left[v]);
+            }
+            for (size_t j = i; j < i + run; j++) {
+                float *frame = out + j * Lanes;
+                for (size_t v = 0; v < Lanes; v++) {
+                    frame[v] = target[v] + distance[v];
+                    distance[v] *= rate[v];
+                }
+            }
+            for (size_t v = 0; v < Lanes; v++) {
+                if (left[v] != forever) {
+                    left[v] -= run;
+                    if (!left[v]) {
+                        finish(v);
+                    }
+                }
+            }
+            i += run;
+        }
+    }
+};
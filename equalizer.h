@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "filters.h"
+
+enum class BandType {
+    Peak,
+    LowShelf,
+    HighShelf,
+    LowCut,
+    HighCut,
+};
+
+// One band of a parametric EQ: gain dB at hz for the peak and shelves, q
+// its width (or a shelf's slope, or a cut's resonance).
+struct EqBand {
+    BandType type = BandType::Peak;
+    float hz = 1000;
+    float gain = 0;
+    float q = 0.707f;
+    bool operator==(const EqBand &) const = default;
+};
+
+struct EqShape {
+    static constexpr size_t max_bands = 8;
+    size_t count = 0;
+    EqBand bands[max_bands];
+    bool operator==(const EqShape &) const = default;
+};
+
+// Coefficients of a biquad normalised by a0, from the RBJ cookbook.
+struct Biquad {
+    float b0 = 1;
+    float b1 = 0;
+    float b2 = 0;
+    float a1 = 0;
+    float a2 = 0;
+
+    static Biquad design(const EqBand &band, float rate) {
+        auto w = 2 * M_PI * std::clamp(band.hz, 10.0f, max_cutoff(rate)) / rate;
+        auto cosine = std::cos(w);
+        auto alpha = std::sin(w) / (2 * std::max(band.q, 0.1f));
+        auto a = std::pow(10.0, band.gain / 40.0);
+        auto root = 2 * std::sqrt(a) * alpha;
+        // a type out of range passes the signal through
+        double b[3] = {1, 0, 0}, d[3] = {1, 0, 0};
+        switch (band.type) {
+        case BandType::Peak:
+            b[0] = 1 + alpha * a, b[1] = -2 * cosine, b[2] = 1 - alpha * a;
+            d[0] = 1 + alpha / a, d[1] = -2 * cosine, d[2] = 1 - alpha / a;
+            break;
+        case BandType::LowShelf:
+            b[0] = a * ((a + 1) - (a - 1) * cosine + root);
+            b[1] = 2 * a * ((a - 1) - (a + 1) * cosine);
+            b[2] = a * ((a + 1) - (a - 1) * cosine - root);
+            d[0] = (a + 1) + (a - 1) * cosine + root;
+            d[1] = -2 * ((a - 1) + (a + 1) * cosine);
+            d[2] = (a + 1) + (a - 1) * cosine - root;
+            break;
+        case BandType::HighShelf:
+            b[0] = a * ((a + 1) + (a - 1) * cosine + root);
+            b[1] = -2 * a * ((a - 1) + (a + 1) * cosine);
+            b[2] = a * ((a + 1) + (a - 1) * cosine - root);
+            d[0] = (a + 1) - (a - 1) * cosine + root;
+            d[1] = 2 * ((a - 1) - (a + 1) * cosine);
+            d[2] = (a + 1) - (a - 1) * cosine - root;
+            break;
+        case BandType::LowCut:
+            b[0] = (1 + cosine) / 2, b[1] = -(1 + cosine), b[2] = (1 + cosine) / 2;
+            d[0] = 1 + alpha, d[1] = -2 * cosine, d[2] = 1 - alpha;
+            break;
+        case BandType::HighCut:
+            b[0] = (1 - cosine) / 2, b[1] = 1 - cosine, b[2] = (1 - cosine) / 2;
+            d[0] = 1 + alpha, d[1] = -2 * cosine, d[2] = 1 - alpha;
+            break;
+        }
+        return {float(b[0] / d[0]), float(b[1] / d[0]), float(b[2] / d[0]), float(d[1] / d[0]), float(d[2] / d[0])};
+    }
+};
+
+// A cascade of biquads in transposed direct form II over Lanes voices or
+// channels, [frame * Lanes + lane] as the filters: every lane shares the
+// coefficients and keeps its own state, so the loop over lanes vectorises.
+// A new shape is designed once and the coefficients glide to it linearly
+// over ramp frames instead of being recomputed as they move.
+template <size_t Lanes>
+struct Equalizer {
+    static constexpr size_t max_bands = EqShape::max_bands;
+    static constexpr size_t ramp = 64;
+    float rate;
+    EqShape shape;
+    size_t bands = 0;
+    Biquad now[max_bands];
+    Biquad step[max_bands];
+    Biquad target[max_bands];
+    size_t left = 0;
+    float s1[max_bands][Lanes] = {};
+    float s2[max_bands][Lanes] = {};
+
+    explicit Equalizer(float rate_hz) :
+        rate(rate_hz) {}
+
+    // bands being dropped glide to a pass through first
+    void set_shape(const EqShape &new_shape) {
+        if (new_shape == shape) {
+            return;
+        }
+        shape = new_shape;
+        shape.count = std::min(shape.count, max_bands);
+        for (size_t b = 0; b < max_bands; b++) {
+            target[b] = b < shape.count ? Biquad::design(shape.bands[b], rate) : Biquad();
+            step[b] = {(target[b].b0 - now[b].b0) / ramp, (target[b].b1 - now[b].b1) / ramp,
+                       (target[b].b2 - now[b].b2) / ramp, (target[b].a1 - now[b].a1) / ramp,
+                       (target[b].a2 - now[b].a2) / ramp};
+        }
+        bands = std::max(bands, shape.count);
+        left = ramp;
+    }
+
+    void clear(size_t lane) {
+        for (size_t b = 0; b < max_bands; b++) {
+            s1[b][lane] = 0;
+            s2[b][lane] = 0;
+        }
+    }
+
+    // straight to the shape with nothing ringing, as after a seek
+    void clear() {
+        std::copy(target, target + max_bands, now);
+        bands = shape.count;
+        left = 0;
+        for (size_t v = 0; v < Lanes; v++) {
+            clear(v);
+        }
+    }
+
+    // samples for the slowest pole of each band to fall to 0.1%
+    uint64_t settle_length() const {
+        double length = 0;
+        for (size_t b = 0; b < bands; b++) {
+            auto radius = std::sqrt(std::max(double(target[b].a2), 0.0));
+            length += radius > 0 ? std::log(1e3) / -std::log(std::min(radius, 0.9999)) : 0;
+        }
+        return std::min<uint64_t>(static_cast<uint64_t>(length) + 1, uint64_t(rate));
+    }
+
+    void process(float *data, size_t count) {
+        auto gliding = std::min(count, left);
+        for (size_t b = 0; b < bands; b++) {
+            float z1[Lanes];
+            float z2[Lanes];
+            std::copy(s1[b], s1[b] + Lanes, z1);
+            std::copy(s2[b], s2[b] + Lanes, z2);
+            auto c = now[b];
+            // the terms that don't wait on y are grouped first, so only a
+            // multiply and a subtract lie between one frame's y and the next
+            auto run = [&](float *frame) {
+                for (size_t v = 0; v < Lanes; v++) {
+                    auto x = frame[v];
+                    auto y = c.b0 * x + z1[v];
+                    z1[v] = (c.b1 * x + z2[v]) - c.a1 * y;
+                    z2[v] = c.b2 * x - c.a2 * y;
+                    frame[v] = y;
+                }
+            };
+            for (size_t i = 0; i < gliding; i++) {
+                run(data + i * Lanes);
+                auto &d = step[b];
+                c = left - i == 1 ? target[b] :
+                    Biquad{c.b0 + d.b0, c.b1 + d.b1, c.b2 + d.b2, c.a1 + d.a1, c.a2 + d.a2};
+            }
+            for (size_t i = gliding; i < count; i++) {
+                run(data + i * Lanes);
+            }
+            now[b] = c;
+            std::copy(z1, z1 + Lanes, s1[b]);
+            std::copy(z2, z2 + Lanes, s2[b]);
+        }
+        left -= gliding;
+        if (!left) {
+            for (; bands > shape.count; bands--) {
+                std::fill(s1[bands - 1], s1[bands - 1] + Lanes, 0.0f);
+                std::fill(s2[bands - 1], s2[bands - 1] + Lanes, 0.0f);
+            }
+        }
+    }
+};
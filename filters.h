@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "fastmath.h"
+
+enum class FilterType {
+    LowPass,
+    Ladder,
+    StateVariable,
+};
+
+constexpr float max_cutoff(float sample_rate) {
+    return sample_rate * 0.45f;
+}
+
+inline size_t count_subnormal(const float *values, size_t count) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        n += std::fpclassify(values[i]) == FP_SUBNORMAL;
+    }
+    return n;
+}
+
+// Four one-pole stages with feedback from the last stage for resonance. The
+// feedback is solved for the same sample rather than taken from the last
+// one, as in Ladder below: a sample's delay in the loop turns it unstable
+// near Nyquist at high resonance. The pole is only recomputed when set()
+// is given a different cutoff. Same lane layout as Ladder.
+template <size_t Lanes>
+struct LowPass {
+    float sample_rate;
+    float pole_cutoff[Lanes] = {};
+    float rc[Lanes] = {};
+    float k[Lanes] = {};
+    // 1 / (1 + k rc^4), which solves the feedback at the held cutoff
+    float solve[Lanes] = {};
+    float value[4][Lanes] = {};
+
+    LowPass(float rate) :
+        sample_rate(rate) {}
+
+    void set(size_t lane, float cutoff, float resonance) {
+        k[lane] = 4 * std::clamp(resonance, 0.0f, 0.99f);
+        if (cutoff != pole_cutoff[lane]) {
+            pole_cutoff[lane] = cutoff;
+            rc[lane] = pole(cutoff);
+        }
+        auto p = rc[lane];
+        solve[lane] = 1.0f / (1.0f + k[lane] * p * p * p * p);
+    }
+
+    float pole(float cutoff) const {
+        auto w = 2 * static_cast<float>(M_PI) * cutoff / sample_rate;
+        return 1.0f - fast_exp2(-w * static_cast<float>(M_LOG2E));
+    }
+
+    void prime(size_t lane, float level) {
+        for (auto &stage : value) {
+            stage[lane] = level;
+        }
+    }
+
+    // modulation, if given, is a cutoff in Hz per sample and lane
+    void process(float *data, size_t count, const float *modulation = nullptr) {
+        for (size_t i = 0; i < count; i++) {
+            float *frame = data + i * Lanes;
+            for (size_t v = 0; v < Lanes; v++) {
+                auto p = modulation ? pole(std::min(modulation[i * Lanes + v], max_cutoff(sample_rate))) : rc[v];
+                // each stage is (1 - p) of its state plus p of its input,
+                // so the last stage is p^4 of the loop's input plus sigma
+                auto q = 1.0f - p;
+                auto sigma = q * (value[3][v] + p * (value[2][v] + p * (value[1][v] + p * value[0][v])));
+                auto p4 = p * p * p * p;
+                auto x = frame[v] * (1.0f + k[v]);
+                auto y = (p4 * x + sigma) * (modulation ? 1.0f / (1.0f + k[v] * p4) : solve[v]);
+                auto in = x - k[v] * y;
+                for (int j = 0; j < 4; j++) {
+                    value[j][v] += p * (in - value[j][v]);
+                    in = value[j][v];
+                }
+                frame[v] = in;
+            }
+        }
+    }
+
+    size_t denormals() const {
+        return count_subnormal(&value[0][0], 4 * Lanes);
+    }
+};
+
+// Zero delay feedback Moog ladder: four trapezoidal one-poles with the
+// feedback loop solved each sample. Lanes voices are processed together,
+// data and cutoff are interleaved as [sample * Lanes + lane] so the inner
+// loop over lanes vectorises.
+template <size_t Lanes>
+struct Ladder {
+    float sample_rate;
+    float g[Lanes] = {};
+    float cutoff[Lanes] = {};
+    float k[Lanes] = {};
+    float s[4][Lanes] = {};
+
+    Ladder(float rate) :
+        sample_rate(rate) {}
+
+    float prewarp(float hz) const {
+        hz = std::clamp(hz, 10.0f, max_cutoff(sample_rate));
+        return fast_tan(static_cast<float>(M_PI) * hz / sample_rate);
+    }
+
+    void set(size_t lane, float hz, float resonance) {
+        k[lane] = 4 * std::clamp(resonance, 0.0f, 0.99f);
+        if (hz != cutoff[lane]) {
+            cutoff[lane] = hz;
+            g[lane] = prewarp(hz);
+        }
+    }
+
+    void prime(size_t lane, float level) {
+        for (auto &stage : s) {
+            stage[lane] = level;
+        }
+    }
+
+    // modulation, if given, is a cutoff in Hz per sample and lane
+    void process(float *data, size_t count, const float *modulation = nullptr) {
+        for (size_t i = 0; i < count; i++) {
+            float *frame = data + i * Lanes;
+            for (size_t v = 0; v < Lanes; v++) {
+                auto gv = modulation ? prewarp(modulation[i * Lanes + v]) : g[v];
+                auto G = gv / (1.0f + gv);
+                auto H = 1.0f - G;
+                auto sigma = H * (G * (G * (G * s[0][v] + s[1][v]) + s[2][v]) + s[3][v]);
+                auto G4 = G * G * G * G;
+                auto x = frame[v] * (1.0f + k[v]);
+                auto y = (G4 * x + sigma) / (1.0f + k[v] * G4);
+                auto in = x - k[v] * y;
+                for (int j = 0; j < 4; j++) {
+                    auto w = (in - s[j][v]) * G;
+                    auto out = w + s[j][v];
+                    s[j][v] = out + w;
+                    in = out;
+                }
+                frame[v] = in;
+            }
+        }
+    }
+
+    size_t denormals() const {
+        return count_subnormal(&s[0][0], 4 * Lanes);
+    }
+};
+
+enum class SvfMode {
+    LowPass,
+    BandPass,
+    HighPass,
+};
+
+// Trapezoidal state variable filter (Simper), 12dB/octave with resonance
+// from 0 (damped) to 1 (on the edge of self oscillation). Same lane layout
+// as Ladder.
+template <size_t Lanes>
+struct StateVariable {
+    float sample_rate;
+    SvfMode mode = SvfMode::LowPass;
+    float g[Lanes] = {};
+    float cutoff[Lanes] = {};
+    float damping[Lanes] = {};
+    float ic1[Lanes] = {};
+    float ic2[Lanes] = {};
+
+    StateVariable(float rate) :
+        sample_rate(rate) {}
+
+    float prewarp(float hz) const {
+        hz = std::clamp(hz, 10.0f, max_cutoff(sample_rate));
+        return fast_tan(static_cast<float>(M_PI) * hz / sample_rate);
+    }
+
+    void set(size_t lane, float hz, float resonance) {
+        damping[lane] = 2.0f - 2.0f * std::clamp(resonance, 0.0f, 0.99f);
+        if (hz != cutoff[lane]) {
+            cutoff[lane] = hz;
+            g[lane] = prewarp(hz);
+        }
+    }
+
+    void prime(size_t lane, float level) {
+        ic1[lane] = 0;
+        ic2[lane] = mode == SvfMode::LowPass ? level : 0;
+    }
+
+    void process(float *data, size_t count, const float *modulation = nullptr) {
+        auto low = mode == SvfMode::LowPass ? 1.0f : 0.0f;
+        auto band = mode == SvfMode::BandPass ? 1.0f : 0.0f;
+        auto high = mode == SvfMode::HighPass ? 1.0f : 0.0f;
+        for (size_t i = 0; i < count; i++) {
+            float *frame = data + i * Lanes;
+            for (size_t v = 0; v < Lanes; v++) {
+                auto gv = modulation ? prewarp(modulation[i * Lanes + v]) : g[v];
+                auto a1 = 1.0f / (1.0f + gv * (gv + damping[v]));
+                auto a2 = gv * a1;
+                auto a3 = gv * a2;
+                auto x = frame[v];
+                auto v3 = x - ic2[v];
+                auto v1 = a1 * ic1[v] + a2 * v3;
+                auto v2 = ic2[v] + a2 * ic1[v] + a3 * v3;
+                ic1[v] = 2 * v1 - ic1[v];
+                ic2[v] = 2 * v2 - ic2[v];
+                frame[v] = low * v2 + band * v1 + high * (x - damping[v] * v1 - v2);
+            }
+        }
+    }
+
+    size_t denormals() const {
+        return count_subnormal(ic1, Lanes) + count_subnormal(ic2, Lanes);
+    }
+};
+
+// One of each filter over the same lanes; only the selected type runs.
+template <size_t Lanes>
+struct FilterBank {
+    LowPass<Lanes> lowpass;
+    Ladder<Lanes> ladder;
+    StateVariable<Lanes> svf;
+
+    FilterBank(float rate) :
+        lowpass(rate), ladder(rate), svf(rate) {}
+
+    void prime(size_t lane, float level) {
+        lowpass.prime(lane, level);
+        ladder.prime(lane, level);
+        svf.prime(lane, level);
+    }
+
+    void set(FilterType type, size_t lane, float hz, float resonance) {
+        switch (type) {
+        case FilterType::LowPass:
+            lowpass.set(lane, hz, resonance);
+            break;
+        case FilterType::Ladder:
+            ladder.set(lane, hz, resonance);
+            break;
+        case FilterType::StateVariable:
+            svf.set(lane, hz, resonance);
+            break;
+        }
+    }
+
+    void process(FilterType type, float *data, size_t count, const float *modulation) {
+        switch (type) {
+        case FilterType::LowPass:
+            lowpass.process(data, count, modulation);
+            break;
+        case FilterType::Ladder:
+            ladder.process(data, count, modulation);
+            break;
+        case FilterType::StateVariable:
+            svf.process(data, count, modulation);
+            break;
+        }
+    }
+
+    size_t denormals(FilterType type) const {
+        switch (type) {
+        case FilterType::LowPass:
+            return lowpass.denormals();
+        case FilterType::Ladder:
+            return ladder.denormals();
+        case FilterType::StateVariable:
+            return svf.denormals();
+        }
+        return 0;
+    }
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// One cycle of sine in table_size steps with a guard point, read with
+// linear interpolation from a 32 bit phase: the top table_bits bits index
+// the table, the rest are the fraction.
+struct SineTable {
+    static constexpr uint32_t table_bits = 12;
+    static constexpr uint32_t table_size = 1u << table_bits;
+    static constexpr uint32_t fraction_bits = 32 - table_bits;
+    float values[table_size + 1];
+
+    SineTable() {
+        for (uint32_t i = 0; i <= table_size; i++) {
+            values[i] = std::sin(2 * M_PI * i / table_size);
+        }
+    }
+
+    float operator()(uint32_t phase) const {
+        auto index = phase >> fraction_bits;
+        auto fraction = (phase & ((1u << fraction_bits) - 1)) * (1.0f / (1u << fraction_bits));
+        return values[index] + (values[index + 1] - values[index]) * fraction;
+    }
+};
+
+inline const SineTable sine_table;
+
+enum class FmAlgorithm {
+    Stack,      // each operator modulates the one below, 0 is heard
+    Pairs,      // even operators heard, each modulated by the next
+    Branch,     // 0 heard, modulated by all the others
+    Parallel,   // all heard, additive
+};
+
+// Up to max_operators sine operators at ratio times the note. Operator i
+// can only be modulated by operators above it, listed as bits in
+// modulators[i]; carriers are the ones mixed to the output. level is the
+// peak amplitude of a carrier, or the peak phase deviation in radians of a
+// modulator. The top operator modulates itself by feedback radians.
+struct FmShape {
+    static constexpr size_t max_operators = 6;
+    struct Operator {
+        float ratio = 1;
+        float level = 0;
+        bool operator==(const Operator &) const = default;
+    };
+    Operator operators[max_operators];
+    uint8_t modulators[max_operators] = {};
+    uint8_t carriers = 1;
+    size_t count = 0;
+    float feedback = 0;
+
+    static FmShape algorithm(FmAlgorithm algorithm, size_t count) {
+        auto shape = FmShape();
+        shape.count = std::min(count, max_operators);
+        shape.carriers = 0;
+        for (size_t i = 0; i < shape.count; i++) {
+            auto above = i + 1 < shape.count ? uint8_t(1u << (i + 1)) : uint8_t(0);
+            switch (algorithm) {
+            case FmAlgorithm::Stack:
+                shape.modulators[i] = above;
+                shape.carriers |= i == 0;
+                break;
+            case FmAlgorithm::Pairs:
+                shape.modulators[i] = i % 2 == 0 ? above : 0;
+                shape.carriers |= i % 2 == 0 ? 1u << i : 0;
+                break;
+            case FmAlgorithm::Branch:
+                shape.modulators[i] = i == 0 ? uint8_t(((1u << shape.count) - 1) & ~1u) : 0;
+                shape.carriers |= i == 0;
+                break;
+            case FmAlgorithm::Parallel:
+                shape.carriers |= 1u << i;
+                break;
+            }
+        }
+        auto heard = std::popcount(shape.carriers);
+        for (size_t i = 0; i < shape.count; i++) {
+            shape.operators[i].level = shape.carriers & (1u << i) ? 1.0f / heard : 1.0f;
+        }
+        return shape;
+    }
+
+    bool operator==(const FmShape &) const = default;
+};
+
+// FM voices for Lanes lanes into [sample * Lanes + lane] blocks, the loop
+// over lanes innermost. Phases are 32 bit fixed point and wrap by
+// overflowing, so skipping ahead is exact.
+template <size_t Lanes>
+struct Fm {
+    static constexpr float radians_to_phase = 4294967296.0f / (2 * static_cast<float>(M_PI));
+    FmShape shape;
+    uint32_t phase[FmShape::max_operators][Lanes] = {};
+    float last[Lanes] = {};
+
+    void set_shape(const FmShape &new_shape) {
+        shape = new_shape;
+    }
+
+    void start(size_t lane) {
+        for (auto &op : phase) {
+            op[lane] = 0;
+        }
+        last[lane] = 0;
+    }
+
+    // speed is the increment of the carrier in half cycles per sample (the
+    // SawTooth's units) growing by accel each sample
+    static uint32_t increment(float speed, float ratio) {
+        return to_phase(speed * ratio * 2147483648.0f);
+    }
+
+    // a phase offset, wrapping like the phases do
+    static uint32_t to_phase(float x) {
+        return static_cast<uint32_t>(static_cast<int64_t>(x));
+    }
+
+    void skip(size_t lane, uint64_t n, float speed) {
+        for (size_t op = 0; op < shape.count; op++) {
+            phase[op][lane] += static_cast<uint32_t>(n * increment(speed, shape.operators[op].ratio));
+        }
+    }
+
+    // Renders count samples scaled by volume; speed is advanced to where the
+    // SawTooth's would be.
+    void render(float *lanes, size_t count, float volume, float *speed, const float *accel) {
+        uint32_t inc[FmShape::max_operators][Lanes];
+        int32_t grow[FmShape::max_operators][Lanes];
+        for (size_t op = 0; op < shape.count; op++) {
+            auto ratio = shape.operators[op].ratio;
+            for (size_t v = 0; v < Lanes; v++) {
+                inc[op][v] = increment(speed[v], ratio);
+                grow[op][v] = static_cast<int32_t>(accel[v] * ratio * 2147483648.0f);
+            }
+        }
+        float gain[FmShape::max_operators];
+        for (size_t op = 0; op < shape.count; op++) {
+            auto level = shape.operators[op].level;
+            gain[op] = shape.carriers & (1u << op) ? level * volume : level * radians_to_phase;
+        }
+        auto top = shape.count - 1;
+        auto feedback = shape.feedback * radians_to_phase;
+        for (size_t i = 0; i < count; i++) {
+            float out[FmShape::max_operators][Lanes];
+            float *frame = lanes + i * Lanes;
+            std::fill(frame, frame + Lanes, 0.0f);
+            for (size_t op = shape.count; op-- > 0; ) {
+                uint32_t offset[Lanes] = {};
+                for (size_t m = op + 1; m < shape.count; m++) {
+                    if (shape.modulators[op] & (1u << m)) {
+                        for (size_t v = 0; v < Lanes; v++) {
+                            offset[v] += to_phase(out[m][v]);
+                        }
+                    }
+                }
+                if (op == top) {
+                    for (size_t v = 0; v < Lanes; v++) {
+                        offset[v] += to_phase(last[v] * feedback);
+                        last[v] = sine_table(phase[op][v] + offset[v]);
+                    }
+                }
+                for (size_t v = 0; v < Lanes; v++) {
+                    out[op][v] = sine_table(phase[op][v] + offset[v]) * gain[op];
+                    phase[op][v] += inc[op][v];
+                    inc[op][v] += grow[op][v];
+                }
+                if (shape.carriers & (1u << op)) {
+                    for (size_t v = 0; v < Lanes; v++) {
+                        frame[v] += out[op][v];
+                    }
+                }
+            }
+        }
+        for (size_t v = 0; v < Lanes; v++) {
+            speed[v] += accel[v] * count;
+        }
+    }
+};
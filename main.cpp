@@ -1,89 +1,25 @@
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <SDL2/SDL.h>
 
-constexpr size_t buffer_size = 1024;
-constexpr unsigned samples_per_sec = 44100;
+#include "batch.h"
+#include "offline.h"
+#include "shm_ring.h"
+#include "synth.h"
+
+constexpr unsigned shm_blocks = 16;
+constexpr uint32_t wavetable_count = 64;
+constexpr uint32_t wavetable_size = 2048;
+constexpr uint32_t plucked_count = 5;
+constexpr float plucked_seconds = 4;
 
 const char* getError() {
     return SDL_GetError();
 }
 
-struct Synth {
-    uint64_t t = 0;
-
-    struct Sequencer {
-        int bpm = 138 * 4;
-        float pattern[8] = {440, 0,  698.5, 400, 554.4, 698.5, 830.6, 554.4};
-        size_t sample = 0;
-        float tick(size_t count) {
-            auto beat_length = 60 * samples_per_sec / bpm;
-            auto pattern_length = beat_length * 8;
-            auto note = pattern[sample / beat_length];
-            sample = (sample + count) % pattern_length;
-            return note;
-        }
-    } sequencer;
-
-    struct SawTooth {
-        std::atomic<float> tuning_v = 1.0f;
-        float tuning = 1.0;
-        float volume = 0.25;
-        float last = 0;
-        void tick(float note, int16_t *data, size_t count) {
-            float value = last;
-            float delta = 0;
-            if (note) {
-                tuning = std::clamp(tuning * tuning_v, 0.1f, 1000.0f);
-                auto freq = std::clamp(tuning * note, 10.0f, 10000.0f);
-                auto period = samples_per_sec / freq;
-                delta = 2.0 / period;
-                value = last + delta;
-                if (value > 1.0) { value -= 2.0; }
-            }
-            auto scale = SHRT_MAX;
-            for (size_t i = 0; i < count; i++) {
-                data[i] = value * volume * scale;
-                value += delta;
-                if (value > 1.0) { value -= 2.0; }
-            }
-            last = value;
-        }
-    } sawtooth;
-
-    struct LowPass {
-        std::atomic<float> rc_v = 1.0;
-        float rc = 0.5;
-        float value[4] = {0, 0, 0, 0};
-        void tick(int16_t *data, size_t count) {
-            rc = std::clamp(rc * rc_v, 0.0f, 1.0f);
-            for (int j = 0; j < 4; j++) {
-                for (size_t i = 0; i < count; i++) {
-                    value[j] = std::clamp(data[i] * rc + value[j] * (1.0 - rc),
-                        static_cast<double>(SHRT_MIN), static_cast<double>(SHRT_MAX));
-                    data[i] = value[j];
-                }
-            }
-        }
-    } lowpass;
-
-    void make_sound(int16_t *data, size_t count) {
-        auto note = sequencer.tick(count);
-        sawtooth.tick(note, data, count);
-        lowpass.tick(data, count);
-    }
-
-    void tuning(int a) {
-        sawtooth.tuning_v = 1.0 + 0.01 * a;
-    }
-
-    void cutoff(int a) {
-        lowpass.rc_v = 1.0 + 0.01 * a;
-    }
-};
-
 struct CircularBuffer {
     std::vector<int16_t> samples;
     std::atomic<size_t> write_a = 0;
@@ -145,7 +81,7 @@ struct CircularBuffer {
 
 struct Audio {
     Audio():
-        buffer(buffer_size * 2) {}
+        buffer(buffer_size * channels * 2) {}
 
     void play();
 
@@ -153,10 +89,30 @@ struct Audio {
         synth.tuning(a);
     }
 
+    void toggle_playing() {
+        if (synth.playing) {
+            synth.stop();
+        } else {
+            synth.play();
+        }
+    }
+
+    void seek(uint64_t sample) {
+        synth.seek(sample);
+    }
+
+    void filter_type(FilterType type) {
+        synth.filter_type(type);
+    }
+
     void cutoff(int a) {
         synth.cutoff(a);
     }
 
+    void load(const Patch &patch) {
+        synth.load(patch);
+    }
+
     SDL_AudioDeviceID dev = 0;
     Synth synth;
 
@@ -169,6 +125,9 @@ struct Audio {
     void notify() {
         cv.notify_one();
     }
+    std::unique_ptr<ShmRing> shm;
+    bool share(const char *name);
+
     bool start();
     ~Audio();
 };
@@ -199,7 +158,7 @@ bool Audio::start() {
     auto want = SDL_AudioSpec();
     want.freq = samples_per_sec;
     want.format = AUDIO_S16LSB;
-    want.channels = 1;
+    want.channels = channels;
     want.samples = buffer_size;
     want.callback = audioCallback;
     want.userdata = this;
@@ -224,17 +183,30 @@ Audio::~Audio() {
     SDL_CloseAudioDevice(dev);
 }
 
+bool Audio::share(const char *name) {
+    auto ring = std::make_unique<ShmRing>();
+    if (!ring->create(name, samples_per_sec, channels, buffer_size, shm_blocks)) {
+        return false;
+    }
+    shm = std::move(ring);
+    return true;
+}
+
 void Audio::play() {
     if (thread.joinable()) {
         return;
     }
     thread = std::thread([this]() {
+        FlushDenormals flush;
         bool should_quit = false;
         while(!should_quit) {
             //printf("t");
-            std::array<int16_t, buffer_size> data;
+            std::array<int16_t, buffer_size * channels> data;
 
-            synth.make_sound(data.data(), data.size());
+            synth.make_sound(data.data(), buffer_size);
+            if (shm) {
+                shm->write(data.data(), data.size(), synth.block_time);
+            }
 
             auto left = buffer.copy_in(data.data(), data.size());
             if (left) {
@@ -352,15 +324,195 @@ struct SDL {
     }
 };
 
-int main() {
+int main(int argc, char **argv) {
+    const char *shm_name = nullptr;
+    const char *wavetable = nullptr;
+    const char *samples = nullptr;
+    const char *impulse = nullptr;
+    const char *render = nullptr;
+    const char *batch = nullptr;
+    double seconds = 60;
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    uint64_t start = 0;
+    size_t unison = 1;
+    auto effects = EffectsShape();
+    auto drive = ShaperShape();
+    auto dynamics = DynamicsShape();
+    auto eq = EqShape();
+    auto master_eq = EqShape();
+    auto drums = DrumShape();
+    std::optional<NoiseColor> noise;
+    auto isa = Isa::Default;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+            start = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--wavetable") == 0 && i + 1 < argc) {
+            wavetable = argv[++i];
+        } else if (strcmp(argv[i], "--unison") == 0 && i + 1 < argc) {
+            unison = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--drive") == 0 && i + 1 < argc) {
+            drive.drive = strtof(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--oversample") == 0 && i + 1 < argc) {
+            drive.oversample = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--post-filter") == 0) {
+            drive.post_filter = true;
+        } else if (strcmp(argv[i], "--eq") == 0) {
+            master_eq.count = 3;
+            master_eq.bands[0] = {BandType::LowShelf, 100, 3};
+            master_eq.bands[1] = {BandType::Peak, 350, -3, 1};
+            master_eq.bands[2] = {BandType::HighShelf, 8000, 2};
+        } else if (strcmp(argv[i], "--voice-eq") == 0 && i + 1 < argc) {
+            eq.count = 1;
+            eq.bands[0] = {BandType::Peak, strtof(argv[++i], nullptr), 9, 3};
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            dynamics.compressor.ratio = 4;
+            dynamics.compressor.makeup = 6;
+        } else if (strcmp(argv[i], "--no-limit") == 0) {
+            dynamics.limiter.on = false;
+        } else if (strcmp(argv[i], "--noise") == 0) {
+            noise = NoiseColor::White;
+        } else if (strcmp(argv[i], "--pink") == 0) {
+            noise = NoiseColor::Pink;
+        } else if (strcmp(argv[i], "--drums") == 0) {
+            drums = DrumShape::groove();
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            render = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = argv[++i];
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc) {
+            if (!parse_isa(argv[++i], isa)) {
+                printf("unknown isa %s, not scalar or %s\n", argv[i], isa_name(Isa::Default));
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--echo") == 0) {
+            effects.echo.mix = 0.3f;
+        } else if (strcmp(argv[i], "--chorus") == 0) {
+            effects.chorus = SweepShape::chorus(0.5f);
+        } else if (strcmp(argv[i], "--flanger") == 0) {
+            effects.flanger = SweepShape::flanger(0.5f);
+        } else if (strcmp(argv[i], "--reverb") == 0) {
+            effects.reverb.mix = 0.3f;
+        } else if (strcmp(argv[i], "--ir") == 0 && i + 1 < argc) {
+            impulse = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = argv[++i];
+        } else if (strcmp(argv[i], "--make-samples") == 0 && i + 1 < argc) {
+            auto plucked = plucked_samples(plucked_count, samples_per_sec, plucked_seconds);
+            std::vector<SampleSource> sources;
+            for (size_t s = 0; s < plucked.size(); s++) {
+                sources.push_back({plucked[s].data(), plucked[s].size(), 110.0f * (1u << s)});
+            }
+            return write_sample_library(argv[++i], samples_per_sec, sources) ? 0 : 1;
+        } else if (strcmp(argv[i], "--make-wavetable") == 0 && i + 1 < argc) {
+            auto cycles = basic_wavetables(wavetable_count, wavetable_size);
+            return write_wavetable_bank(argv[++i], cycles.data(), wavetable_count, wavetable_size) ? 0 : 1;
+        }
+    }
+    auto patch = Patch();
+    patch.unison.count = unison;
+    patch.effects = effects;
+    patch.drive = drive;
+    patch.dynamics = dynamics;
+    patch.eq = eq;
+    patch.master_eq = master_eq;
+    patch.drums = drums;
+    if (noise) {
+        patch.oscillator = Oscillator::Noise;
+        patch.noise = *noise;
+    }
+    if (wavetable) {
+        patch.wavetable = WavetableBank::open(wavetable);
+        if (!patch.wavetable) {
+            return 1;
+        }
+        patch.oscillator = Oscillator::Wavetable;
+    }
+    if (impulse) {
+        patch.impulse = ImpulseResponse::load(impulse, samples_per_sec);
+        if (!patch.impulse) {
+            return 1;
+        }
+        patch.effects.convolution.mix = 0.3f;
+    }
+    if (samples) {
+        patch.samples = SampleLibrary::open(samples);
+        if (!patch.samples) {
+            return 1;
+        }
+        patch.oscillator = Oscillator::Sampler;
+    }
+    printf("dsp kernels: %s\n", isa_name(isa));
+
+    // offline: seconds of the pattern from the start to a wav, no audio device
+    if (render) {
+        auto frames = static_cast<uint64_t>(std::max(seconds, 0.0) * samples_per_sec);
+        if (frames > WavWriter::max_frames(channels)) {
+            printf("%.1f s is past the 4 GiB a wav can hold, %.1f s at most\n", seconds,
+                   double(WavWriter::max_frames(channels)) / samples_per_sec);
+            return 1;
+        }
+        WavWriter writer;
+        if (!writer.open(render, channels, samples_per_sec)) {
+            return 1;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        render_offline(patch, Synth::Sequencer(), frames, threads, [&](const int16_t *data, uint64_t n) {
+            writer.write(data, n);
+        }, isa);
+        auto took = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("rendered %.1f s in %.2f s on %zu threads, %.1fx realtime\n", seconds, took, threads,
+               seconds / took);
+        if (patch.samples && patch.samples->underruns) {
+            printf("%llu sample blocks not yet streamed in\n",
+                   static_cast<unsigned long long>(patch.samples->underruns.load()));
+        }
+        return writer.finish() ? 0 : 1;
+    }
+
+    // every job of a manifest, its own patch and pattern, to its own wav
+    if (batch) {
+        std::vector<RenderJob> jobs;
+        if (!read_manifest(batch, jobs)) {
+            return 1;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        render_batch(jobs, threads, isa);
+        auto took = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        double audio = 0;
+        auto ok = true;
+        for (auto &job : jobs) {
+            printf("%-40s %8.1f s in %9.1f ms, %8.1fx realtime%s\n", job.path.c_str(), job.seconds, job.ms,
+                   job.seconds * 1000 / job.ms, job.ok ? "" : ", failed");
+            audio += job.seconds;
+            ok = ok && job.ok;
+        }
+        printf("%zu jobs, %.1f s of audio in %.2f s on %zu threads: %.1f audio seconds per second\n", jobs.size(),
+               audio, took, threads, audio / took);
+        return ok ? 0 : 1;
+    }
+
     SDL sdl;
     sdl.init();
     auto window = sdl.createWindow(100, 100);
     auto audio = sdl.createAudio();
     auto keyboard = sdl.createKeyboard();
     bool shouldQuit = false;
+    if (shm_name && !audio->share(shm_name)) {
+        return 1;
+    }
+    audio->synth.isa = isa;
+    audio->synth.realtime = true;
+    audio->load(patch);
+    audio->seek(start);
     audio->play();
 
+    bool space_down = false;
     while (!shouldQuit) {
         while (auto event = sdl.pollEvent()) {
             switch (event->event.type) {
@@ -372,6 +524,22 @@ int main() {
         if (keyboard->pressed(SDL_SCANCODE_ESCAPE)) {
             shouldQuit = true;
         }
+        if (keyboard->pressed(SDL_SCANCODE_SPACE) != space_down) {
+            space_down = !space_down;
+            if (space_down) {
+                audio->toggle_playing();
+            }
+        }
+        if (keyboard->pressed(SDL_SCANCODE_HOME)) {
+            audio->seek(0);
+        }
+        if (keyboard->pressed(SDL_SCANCODE_1)) {
+            audio->filter_type(FilterType::LowPass);
+        } else if (keyboard->pressed(SDL_SCANCODE_2)) {
+            audio->filter_type(FilterType::Ladder);
+        } else if (keyboard->pressed(SDL_SCANCODE_3)) {
+            audio->filter_type(FilterType::StateVariable);
+        }
         if (keyboard->pressed(SDL_SCANCODE_UP)) {
             audio->tuning(1);
         } else if(keyboard->pressed(SDL_SCANCODE_DOWN)) {
@@ -390,5 +558,23 @@ int main() {
 
     }
 
+    if (auto denormals = audio->synth.denormals.load()) {
+        printf("%llu denormal filter states\n", static_cast<unsigned long long>(denormals));
+    }
+    if (auto skipped = audio->synth.skipped_blocks.load()) {
+        printf("%llu idle blocks skipped\n", static_cast<unsigned long long>(skipped));
+    }
+    if (auto gain = audio->synth.dynamics.lowest_gain.load(); gain < 1) {
+        printf("limiter took peaks down by up to %.1f dB\n", -20 * std::log10(gain));
+    }
+    if (auto &convolution = audio->synth.effects.convolution; convolution.convolver && convolution.convolver->late) {
+        printf("%llu convolution blocks late\n",
+               static_cast<unsigned long long>(convolution.convolver->late.load()));
+    }
+    if (patch.samples && patch.samples->underruns) {
+        printf("%llu sample blocks not yet streamed in\n",
+               static_cast<unsigned long long>(patch.samples->underruns.load()));
+    }
+
     return 0;
 }
\ No newline at end of file
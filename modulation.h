@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+enum class ModSource {
+    Lfo1,
+    Lfo2,
+    Envelope,
+    Velocity,
+    Key,
+    Count,
+};
+
+// Amounts are in semitones for Pitch, octaves for Cutoff, gain added to 1
+// for Volume, -1 (left) to 1 (right) for Pan and the fraction of the bank
+// added to the wavetable position for Position, per unit of source. LFOs
+// run -1 to 1, the envelope, velocity 0 to 1, key is octaves above middle C.
+enum class ModDest {
+    Pitch,
+    Cutoff,
+    Volume,
+    Pan,
+    Position,
+    Count,
+};
+
+constexpr size_t mod_sources = static_cast<size_t>(ModSource::Count);
+constexpr size_t mod_dests = static_cast<size_t>(ModDest::Count);
+
+enum class LfoShape {
+    Sine,
+    Triangle,
+    Square,
+    Saw,
+};
+
+struct Lfo {
+    float rate = 1;
+    LfoShape shape = LfoShape::Sine;
+
+    // The phase comes straight from the sample clock, so an LFO is
+    // where it should be after a seek without being stepped there.
+    float value(uint64_t t, float sample_rate) const {
+        auto cycles = static_cast<double>(t) * rate / sample_rate;
+        auto phase = static_cast<float>(cycles - std::floor(cycles));
+        switch (shape) {
+        case LfoShape::Sine:
+            return std::sin(2 * static_cast<float>(M_PI) * phase);
+        case LfoShape::Triangle:
+            return 1.0f - 4.0f * std::abs(phase - 0.5f);
+        case LfoShape::Square:
+            return phase < 0.5f ? 1.0f : -1.0f;
+        case LfoShape::Saw:
+            return 2.0f * phase - 1.0f;
+        }
+        return 0;
+    }
+
+    bool operator==(const Lfo &) const = default;
+};
+
+struct ModRoute {
+    ModSource source;
+    ModDest dest;
+    float amount;
+
+    bool operator==(const ModRoute &) const = default;
+};
+
+// The routing, part of a Patch. control_block is how many samples apart
+// the matrix is evaluated; values are ramped linearly in between.
+struct ModMatrix {
+    static constexpr size_t max_routes = 8;
+    Lfo lfo[2];
+    ModRoute routes[max_routes] = {};
+    size_t count = 0;
+    size_t control_block = 32;
+
+    bool add(ModSource source, ModDest dest, float amount) {
+        if (count == max_routes) {
+            return false;
+        }
+        routes[count++] = {source, dest, amount};
+        return true;
+    }
+
+    bool uses(ModSource source) const {
+        return std::any_of(routes, routes + count, [&](auto &route) {
+            return route.source == source && route.amount;
+        });
+    }
+
+    bool targets(ModDest dest) const {
+        return std::any_of(routes, routes + count, [&](auto &route) {
+            return route.dest == dest && route.amount;
+        });
+    }
+
+    bool operator==(const ModMatrix &) const = default;
+};
+
+// Matrix output for Lanes voices. evaluate() takes the sources at the start
+// of a control block and sets each destination ramping from where it is
+// to the new value over the block. A restarted lane jumps straight there.
+template <size_t Lanes>
+struct Modulation {
+    ModMatrix matrix;
+    float sources[mod_sources][Lanes] = {};
+    float current[mod_dests][Lanes] = {};
+    float step[mod_dests][Lanes] = {};
+    bool fresh[Lanes] = {};
+
+    void restart(size_t lane) {
+        fresh[lane] = true;
+    }
+
+    bool restarted() const {
+        return std::any_of(std::begin(fresh), std::end(fresh), [](bool f) { return f; });
+    }
+
+    void evaluate(size_t length) {
+        float target[mod_dests][Lanes] = {};
+        for (size_t r = 0; r < matrix.count; r++) {
+            auto &route = matrix.routes[r];
+            auto &in = sources[static_cast<size_t>(route.source)];
+            auto &out = target[static_cast<size_t>(route.dest)];
+            for (size_t v = 0; v < Lanes; v++) {
+                out[v] += route.amount * in[v];
+            }
+        }
+        for (size_t d = 0; d < mod_dests; d++) {
+            for (size_t v = 0; v < Lanes; v++) {
+                if (fresh[v]) {
+                    current[d][v] = target[d][v];
+                }
+                step[d][v] = (target[d][v] - current[d][v]) / length;
+            }
+        }
+        std::fill(std::begin(fresh), std::end(fresh), false);
+    }
+
+    void advance(size_t n) {
+        for (size_t d = 0; d < mod_dests; d++) {
+            for (size_t v = 0; v < Lanes; v++) {
+                current[d][v] += step[d][v] * n;
+            }
+        }
+    }
+
+    const float *at(ModDest dest) const {
+        return current[static_cast<size_t>(dest)];
+    }
+
+    const float *slope(ModDest dest) const {
+        return step[static_cast<size_t>(dest)];
+    }
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "synth.h"
+
+// Renders frames of sequencer playing patch from the start, handing them
+// to write(const int16_t *, uint64_t frames) in order as interleaved 16 bit
+// stereo. The render is cut into chunks that up to threads workers render
+// at once, each chunk by a Synth of its own. The filters and effects are
+// recursive, but a linear filter's state is its input convolved with a
+// decaying response, so only the last settle_length samples of input
+// matter to within a bit. Each chunk's synth therefore seeks to the
+// chunk's first frame, which restarts any note still sounding and renders
+// that lead-in before it, as a seek does in playback. The chunk then
+// matches a single pass to within a bit, and mostly exactly. Chunks are
+// at least eight lead-ins long, so at most an eighth of the work is
+// rendered twice, and at most max_chunk long; only two per worker are
+// held at once, so a long render needn't fit in memory.
+//
+// A sampler patch streams at realtime pace and may underrun here. Every
+// synth playing it holds max_voices of the library's 64 streaming slots,
+// so no more workers run than there are slots for. No synth here keeps a
+// loop cache, as each renders too little of the loop to replay it.
+constexpr uint64_t max_chunk = 30 * samples_per_sec;
+
+template <typename F>
+void render_offline(const Patch &patch, const Synth::Sequencer &sequencer, uint64_t frames, size_t threads,
+                    F &&write, Isa isa = Isa::Default) {
+    auto probe = std::make_unique<Synth>();
+    probe->cache_loops = false;
+    probe->load(patch);
+    probe->make_sound(nullptr, 0);
+    auto lead = std::max<uint64_t>(probe->settle_length(), buffer_size);
+    probe.reset();
+
+    threads = std::max<size_t>(threads, 1);
+    if (patch.samples) {
+        auto free = SampleLibrary::max_slots - std::popcount(patch.samples->owned.load());
+        threads = std::clamp<size_t>(free / max_voices, 1, threads);
+    }
+    // whole blocks, so every chunk renders on the grid a single pass would
+    auto chunk = std::clamp<uint64_t>((frames + threads - 1) / threads, 8 * lead, std::max(max_chunk, 8 * lead));
+    chunk = (chunk + buffer_size - 1) / buffer_size * buffer_size;
+    auto chunks = std::max<uint64_t>((frames + chunk - 1) / chunk, 1);
+    auto workers = std::min<uint64_t>(threads, chunks);
+
+    std::vector<std::vector<int16_t>> done(chunks);
+    std::vector<bool> ready(chunks);
+    uint64_t next = 0;
+    uint64_t written = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::thread> pool;
+    for (uint64_t w = 0; w < workers; w++) {
+        pool.emplace_back([&]() {
+            FlushDenormals flush;
+            while (true) {
+                uint64_t at;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&]() { return next >= chunks || next < written + 2 * workers; });
+                    if (next >= chunks) {
+                        return;
+                    }
+                    at = next++;
+                }
+                auto begin = at * chunk;
+                auto n = std::min(chunk, frames - begin);
+                std::vector<int16_t> out(n * channels);
+                auto synth = std::make_unique<Synth>();
+                synth->isa = isa;
+                synth->cache_loops = false;
+                synth->sequencer = sequencer;
+                synth->load(patch);
+                synth->seek(begin);
+                synth->make_sound(out.data(), n);
+                synth.reset();
+                std::lock_guard lock(mutex);
+                done[at] = std::move(out);
+                ready[at] = true;
+                cv.notify_all();
+            }
+        });
+    }
+    while (written < chunks) {
+        std::vector<int16_t> out;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&]() { return ready[written]; });
+            out = std::move(done[written]);
+        }
+        write(out.data(), static_cast<uint64_t>(out.size() / channels));
+        std::lock_guard lock(mutex);
+        written++;
+        cv.notify_all();
+    }
+    for (auto &worker : pool) {
+        worker.join();
+    }
+}
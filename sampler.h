@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A sample library file, native endian:
+//
+//   SampleLibraryHeader                      32 bytes
+//   SampleEntry entries[count]               32 bytes each
+//   int16_t pcm[]                            mono, each sample page aligned
+//
+// The file is mapped, not read, so a library can be far larger than RAM.
+// Opening faults in and, where allowed, locks the first attack_frames of
+// every sample so notes can start at once. Everything after that is paged
+// in by a streamer thread running ahead of each playing voice; the render
+// thread only reads frames the streamer has reported resident and plays
+// silence (counted as an underrun) rather than wait on a page fault.
+
+constexpr uint32_t sample_library_magic = 0x534e5953; // "SYNS"
+constexpr uint32_t sample_library_version = 1;
+
+struct SampleLibraryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t count;
+    uint32_t pad[4];
+};
+static_assert(sizeof(SampleLibraryHeader) == 32);
+
+struct SampleEntry {
+    uint64_t offset;    // bytes from the start of the file
+    uint64_t frames;
+    float root;         // pitch in Hz when played at the library's rate
+    uint32_t pad[3];
+};
+static_assert(sizeof(SampleEntry) == 32);
+
+struct SampleSource {
+    const int16_t *pcm;
+    uint64_t frames;
+    float root;
+};
+
+inline bool write_sample_library(const char *path, uint32_t sample_rate,
+                                 const std::vector<SampleSource> &sources) {
+    auto file = fopen(path, "wb");
+    if (!file) {
+        printf("couldn't create sample library %s\n", path);
+        return false;
+    }
+    auto page = uint64_t(sysconf(_SC_PAGESIZE));
+    auto header = SampleLibraryHeader{sample_library_magic, sample_library_version, sample_rate,
+                                      uint32_t(sources.size()), {}};
+    auto ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    auto offset = sizeof(header) + sources.size() * sizeof(SampleEntry);
+    std::vector<SampleEntry> entries;
+    for (auto &source : sources) {
+        offset = (offset + page - 1) / page * page;
+        entries.push_back({offset, source.frames, source.root, {}});
+        offset += source.frames * sizeof(int16_t);
+    }
+    ok = ok && fwrite(entries.data(), sizeof(SampleEntry), entries.size(), file) == entries.size();
+    for (size_t i = 0; i < sources.size() && ok; i++) {
+        ok = fseek(file, entries[i].offset, SEEK_SET) == 0 &&
+            fwrite(sources[i].pcm, sizeof(int16_t), sources[i].frames, file) == sources[i].frames;
+    }
+    if (fclose(file) != 0 || !ok) {
+        printf("couldn't write sample library %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// count plucked strings an octave apart from 110 Hz, seconds long, made
+// with Karplus-Strong.
+inline std::vector<std::vector<int16_t>> plucked_samples(uint32_t count, uint32_t sample_rate, float seconds) {
+    std::vector<std::vector<int16_t>> samples;
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        auto period = std::max(2u, uint32_t(sample_rate / (110.0f * (1u << i)) + 0.5f));
+        std::vector<float> string(period);
+        for (auto &x : string) {
+            seed = seed * 1664525 + 1013904223;
+            x = (seed >> 8) * (2.0f / (1u << 24)) - 1.0f;
+        }
+        std::vector<int16_t> pcm(size_t(seconds * sample_rate));
+        for (size_t n = 0; n < pcm.size(); n++) {
+            auto &x = string[n % period];
+            auto next = string[(n + 1) % period];
+            pcm[n] = std::clamp(x * 0.5f, -1.0f, 1.0f) * 32767;
+            x = 0.498f * (x + next);
+        }
+        samples.push_back(std::move(pcm));
+    }
+    return samples;
+}
+
+// What the streamer knows about one playing voice. generation changes on
+// every note, after sample, so a late report for the previous note is
+// ignored.
+struct StreamSlot {
+    std::atomic<int32_t> sample = -1;
+    std::atomic<uint32_t> generation = 0;
+    std::atomic<uint64_t> position = 0;
+    // generation << 40 | frames from the start known to be resident
+    std::atomic<uint64_t> ready = 0;
+
+    static constexpr uint64_t frame_mask = (1ull << 40) - 1;
+};
+
+struct SampleLibrary {
+    static constexpr uint64_t attack_frames = 16384;
+    static constexpr size_t max_slots = 64;
+    static constexpr auto stream_interval = std::chrono::milliseconds(2);
+
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    const SampleLibraryHeader *header = nullptr;
+    const SampleEntry *entries = nullptr;
+    uint64_t lookahead = 0;
+
+    StreamSlot slots[max_slots];
+    // bit i is set while slot i belongs to a player
+    std::atomic<uint64_t> owned = 0;
+    static_assert(max_slots == 64);
+    std::atomic<uint64_t> underruns = 0;
+    bool locked = false;
+
+    std::thread streamer;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit = false;
+
+    static std::shared_ptr<SampleLibrary> open(const char *path) {
+        auto fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            printf("couldn't open sample library %s\n", path);
+            return {};
+        }
+        struct stat info;
+        if (fstat(fd, &info) < 0 || size_t(info.st_size) < sizeof(SampleLibraryHeader)) {
+            printf("%s is not a sample library\n", path);
+            close(fd);
+            return {};
+        }
+        auto mem = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            printf("couldn't map sample library %s\n", path);
+            return {};
+        }
+        auto library = std::make_shared<SampleLibrary>();
+        library->base = static_cast<const uint8_t *>(mem);
+        library->size = info.st_size;
+        library->header = static_cast<const SampleLibraryHeader *>(mem);
+        library->entries = reinterpret_cast<const SampleEntry *>(library->header + 1);
+        if (!library->valid()) {
+            printf("%s is not a sample library\n", path);
+            return {};
+        }
+        library->lookahead = library->header->sample_rate;
+        // tails are read once, front to back, by the streamer
+        madvise(mem, info.st_size, MADV_SEQUENTIAL);
+        library->preload();
+        library->streamer = std::thread([library = library.get()]() {
+            library->stream();
+        });
+        return library;
+    }
+
+    bool valid() const {
+        auto &h = *header;
+        if (h.magic != sample_library_magic || h.version != sample_library_version ||
+            !h.sample_rate || sizeof(SampleLibraryHeader) + h.count * sizeof(SampleEntry) > size) {
+            return false;
+        }
+        return std::all_of(entries, entries + h.count, [&](auto &entry) {
+            return entry.root > 0 && entry.offset <= size &&
+                entry.frames <= (size - entry.offset) / sizeof(int16_t);
+        });
+    }
+
+    const int16_t *pcm(int32_t sample) const {
+        return reinterpret_cast<const int16_t *>(base + entries[sample].offset);
+    }
+
+    // The sample nearest in pitch to hz.
+    int32_t nearest(float hz) const {
+        int32_t best = -1;
+        float distance = 0;
+        for (uint32_t i = 0; i < header->count; i++) {
+            auto d = std::abs(std::log2(hz / entries[i].root));
+            if (best < 0 || d < distance) {
+                best = i;
+                distance = d;
+            }
+        }
+        return best;
+    }
+
+    uint64_t attack(int32_t sample) const {
+        return std::min(entries[sample].frames, attack_frames);
+    }
+
+    // Faults in the range on the calling thread.
+    static void touch(const int16_t *from, const int16_t *to) {
+        auto page = size_t(sysconf(_SC_PAGESIZE));
+        volatile int16_t sink = 0;
+        for (auto p = reinterpret_cast<uintptr_t>(from) & ~(page - 1);
+             p < reinterpret_cast<uintptr_t>(to); p += page) {
+            sink = sink + *reinterpret_cast<const int16_t *>(std::max(p, reinterpret_cast<uintptr_t>(from)));
+        }
+    }
+
+    // Attacks stay resident for as long as the library is open; without
+    // the rlimit to lock them they are only faulted in.
+    void preload() {
+        locked = true;
+        for (uint32_t i = 0; i < header->count; i++) {
+            auto from = pcm(i);
+            auto to = from + attack(i);
+            locked = locked && mlock(from, (to - from) * sizeof(int16_t)) == 0;
+            touch(from, to);
+        }
+    }
+
+    static uint64_t mask(size_t count) {
+        return count >= max_slots ? ~0ull : (1ull << count) - 1;
+    }
+
+    // Hands out count adjacent slots to one player, nullptr when there are
+    // none left. They are the player's until it gives them back.
+    StreamSlot *claim(size_t count) {
+        auto now = owned.load();
+        size_t first = 0;
+        while (first + count <= max_slots) {
+            auto want = mask(count) << first;
+            if (now & want) {
+                first++;
+            } else if (owned.compare_exchange_weak(now, now | want)) {
+                return slots + first;
+            } else {
+                // another player got in first, now holds what it took
+                first = 0;
+            }
+        }
+        return nullptr;
+    }
+
+    void release(StreamSlot *from, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            from[i].sample.store(-1, std::memory_order_release);
+        }
+        owned.fetch_and(~(mask(count) << (from - slots)));
+    }
+
+    void stream() {
+        auto page_frames = uint64_t(sysconf(_SC_PAGESIZE)) / sizeof(int16_t);
+        std::unique_lock lock(mutex);
+        while (!cv.wait_for(lock, stream_interval, [this]() { return quit; })) {
+            for (size_t i = 0; i < max_slots; i++) {
+                auto &slot = slots[i];
+                auto generation = slot.generation.load(std::memory_order_acquire);
+                auto sample = slot.sample.load(std::memory_order_relaxed);
+                if (sample < 0) {
+                    continue;
+                }
+                auto frames = entries[sample].frames;
+                auto ready = slot.ready.load(std::memory_order_relaxed);
+                auto have = ready >> 40 == (generation & 0xffffff) ? ready & StreamSlot::frame_mask
+                                                                   : attack(sample);
+                auto want = std::min(frames, slot.position.load(std::memory_order_relaxed) + lookahead);
+                if (have >= want) {
+                    continue;
+                }
+                // start the read beyond this window too, then wait for this one
+                auto ahead = std::min(frames, want + lookahead);
+                auto start = pcm(sample) + have / page_frames * page_frames;
+                madvise(const_cast<int16_t *>(start), (pcm(sample) + ahead - start) * sizeof(int16_t),
+                        MADV_WILLNEED);
+                touch(pcm(sample) + have, pcm(sample) + want);
+                if (slot.generation.load(std::memory_order_acquire) != generation) {
+                    continue;
+                }
+                uint64_t tag = generation & 0xffffff;
+                slot.ready.store(tag << 40 | want, std::memory_order_release);
+            }
+        }
+    }
+
+    ~SampleLibrary() {
+        if (streamer.joinable()) {
+            {
+                std::lock_guard guard(mutex);
+                quit = true;
+            }
+            cv.notify_one();
+            streamer.join();
+        }
+        if (base) {
+            munmap(const_cast<uint8_t *>(base), size);
+        }
+    }
+};
+
+// Sample voices for Lanes lanes into [sample * Lanes + lane] blocks. Each
+// lane plays the library sample nearest its note, resampled with linear
+// interpolation from a 32.32 fixed point position. The library must be
+// released off the render thread, its destructor joins the streamer.
+template <size_t Lanes>
+struct Sampler {
+    std::shared_ptr<SampleLibrary> library;
+    StreamSlot *slots = nullptr;
+    int32_t sample[Lanes];
+    uint64_t position[Lanes] = {};
+
+    Sampler() {
+        std::fill(std::begin(sample), std::end(sample), -1);
+    }
+
+    ~Sampler() {
+        if (slots) {
+            library->release(slots, Lanes);
+        }
+    }
+
+    // Gives the old library's slots back and returns it, for the caller to
+    // drop off the render thread.
+    std::shared_ptr<SampleLibrary> set_library(std::shared_ptr<SampleLibrary> new_library) {
+        if (new_library == library) {
+            return {};
+        }
+        if (slots) {
+            library->release(slots, Lanes);
+        }
+        auto old = std::move(library);
+        library = std::move(new_library);
+        slots = library ? library->claim(Lanes) : nullptr;
+        std::fill(std::begin(sample), std::end(sample), -1);
+        return old;
+    }
+
+    void start(size_t lane, float hz) {
+        position[lane] = 0;
+        sample[lane] = slots ? library->nearest(hz) : -1;
+        if (slots) {
+            auto &slot = slots[lane];
+            slot.position.store(0, std::memory_order_relaxed);
+            slot.sample.store(sample[lane], std::memory_order_relaxed);
+            slot.generation.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    // frames per output sample in 32.32 for speed in half cycles per
+    // sample, the SawTooth's units
+    uint64_t increment(size_t lane, float speed) const {
+        auto &entry = library->entries[sample[lane]];
+        return static_cast<uint64_t>(speed * 0.5f * library->header->sample_rate / entry.root * 4294967296.0f);
+    }
+
+    void skip(size_t lane, uint64_t n, float speed) {
+        if (sample[lane] >= 0) {
+            position[lane] += n * increment(lane, speed);
+            slots[lane].position.store(position[lane] >> 32, std::memory_order_relaxed);
+        }
+    }
+
+    void render(float *lanes, size_t count, float volume, float *speed, const float *accel) {
+        for (size_t v = 0; v < Lanes; v++) {
+            if (sample[v] < 0) {
+                for (size_t i = 0; i < count; i++) {
+                    lanes[i * Lanes + v] = 0;
+                }
+                continue;
+            }
+            auto &slot = slots[v];
+            auto ready = slot.ready.load(std::memory_order_acquire);
+            auto generation = slot.generation.load(std::memory_order_relaxed) & 0xffffff;
+            auto frames = library->entries[sample[v]].frames;
+            auto readable = ready >> 40 == generation ? ready & StreamSlot::frame_mask
+                                                      : library->attack(sample[v]);
+            auto pcm = library->pcm(sample[v]);
+            auto inc = increment(v, speed[v]);
+            auto grow = static_cast<int64_t>(increment(v, accel[v] < 0 ? -accel[v] : accel[v]));
+            grow = accel[v] < 0 ? -grow : grow;
+            auto scale = volume / 32768.0f;
+            bool underrun = false;
+            for (size_t i = 0; i < count; i++) {
+                auto frame = position[v] >> 32;
+                float out = 0;
+                if (frame + 1 < readable) {
+                    auto fraction = (position[v] & 0xffffffff) * (1.0f / 4294967296.0f);
+                    out = (pcm[frame] + (pcm[frame + 1] - pcm[frame]) * fraction) * scale;
+                } else if (frame + 1 < frames) {
+                    underrun = true;
+                }
+                lanes[i * Lanes + v] = out;
+                position[v] += inc;
+                inc += grow;
+            }
+            if (underrun) {
+                library->underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+            slot.position.store(position[v] >> 32, std::memory_order_relaxed);
+            speed[v] += accel[v] * count;
+        }
+    }
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+#include "fastmath.h"
+
+enum class ShaperCurve {
+    Tanh,
+    Cubic,
+};
+
+// Saturation of the voices, drive being the gain into the curve (0 is
+// off), before the filter or after it. oversample is 1, 2 or 4: the curve
+// runs at that multiple of the sample rate so the harmonics it adds above
+// Nyquist are filtered out instead of aliasing back down.
+struct ShaperShape {
+    float drive = 0;
+    ShaperCurve curve = ShaperCurve::Tanh;
+    size_t oversample = 2;
+    bool post_filter = false;
+    bool operator==(const ShaperShape &) const = default;
+};
+
+// Halfband lowpass for changing the rate by two: a Kaiser windowed sinc of
+// 4 * half - 1 taps whose even taps are zero but the centre, so both
+// directions cost half taps per output frame and lane. Same lane layout as
+// the filters, [frame * Lanes + lane]; block is the most frames in at once.
+template <size_t Lanes>
+struct Halfband {
+    size_t half;
+    std::vector<float> taps;
+    std::vector<float> up;
+    std::vector<float> down;
+
+    Halfband(size_t half_taps, float beta, size_t block) :
+        half(half_taps), taps(half_taps),
+        up((2 * half_taps - 1 + block) * Lanes), down((4 * half_taps - 2 + 2 * block) * Lanes) {
+        auto bessel = [](double x) {
+            double sum = 1, term = 1;
+            for (int k = 1; k < 30; k++) {
+                term *= x / (2 * k);
+                sum += term * term;
+            }
+            return sum;
+        };
+        auto length = 4.0 * half - 2;
+        for (size_t j = 0; j < half; j++) {
+            auto k = 2.0 * j + 1;
+            auto r = 2 * k / length;
+            auto window = bessel(beta * std::sqrt(std::max(0.0, 1 - r * r))) / bessel(beta);
+            taps[j] = std::sin(M_PI * k / 2) / (M_PI * k) * window;
+        }
+        // the odd taps of a halfband sum to a half, so DC passes at unity
+        auto sum = std::accumulate(taps.begin(), taps.end(), 0.0f);
+        for (auto &tap : taps) {
+            tap *= 0.25f / sum;
+        }
+    }
+
+    void clear(size_t lane) {
+        for (size_t i = lane; i < up.size(); i += Lanes) {
+            up[i] = 0;
+        }
+        for (size_t i = lane; i < down.size(); i += Lanes) {
+            down[i] = 0;
+        }
+    }
+
+    // count frames in, 2 * count out
+    void upsample(const float *in, float *out, size_t count) {
+        auto history = (2 * half - 1) * Lanes;
+        std::copy(in, in + count * Lanes, up.begin() + history);
+        for (size_t i = 0; i < count; i++) {
+            // summed locally, out could alias the history as far as the
+            // compiler knows and the loop wouldn't vectorise
+            const float *centre = up.data() + (i + half - 1) * Lanes;
+            float odd[Lanes] = {};
+            for (size_t j = 0; j < half; j++) {
+                auto before = centre - j * Lanes;
+                auto after = centre + (j + 1) * Lanes;
+                auto tap = 2 * taps[j];
+                for (size_t v = 0; v < Lanes; v++) {
+                    odd[v] += tap * (before[v] + after[v]);
+                }
+            }
+            std::copy(centre, centre + Lanes, out + 2 * i * Lanes);
+            std::copy(odd, odd + Lanes, out + (2 * i + 1) * Lanes);
+        }
+        std::copy(up.begin() + count * Lanes, up.begin() + count * Lanes + history, up.begin());
+    }
+
+    // 2 * count frames in, count out
+    void downsample(const float *in, float *out, size_t count) {
+        auto history = (4 * half - 2) * Lanes;
+        std::copy(in, in + 2 * count * Lanes, down.begin() + history);
+        for (size_t i = 0; i < count; i++) {
+            const float *centre = down.data() + (2 * half + 2 * i) * Lanes;
+            float frame[Lanes];
+            for (size_t v = 0; v < Lanes; v++) {
+                frame[v] = 0.5f * centre[v];
+            }
+            for (size_t j = 0; j < half; j++) {
+                auto before = centre - (2 * j + 1) * Lanes;
+                auto after = centre + (2 * j + 1) * Lanes;
+                auto tap = taps[j];
+                for (size_t v = 0; v < Lanes; v++) {
+                    frame[v] += tap * (before[v] + after[v]);
+                }
+            }
+            std::copy(frame, frame + Lanes, out + i * Lanes);
+        }
+        std::copy(down.begin() + 2 * count * Lanes, down.begin() + 2 * count * Lanes + history, down.begin());
+    }
+};
+
+// The curve over lanes at up to four times the rate: the first halfband
+// has to keep everything up to 20kHz, the second only has to remove the
+// images of a signal that is already band limited to a quarter of its rate.
+template <size_t Lanes>
+struct Shaper {
+    static constexpr size_t block = 64;
+    Halfband<Lanes> first = Halfband<Lanes>(12, 8, block);
+    Halfband<Lanes> second = Halfband<Lanes>(6, 8, 2 * block);
+    std::vector<float> twice = std::vector<float>(2 * block * Lanes);
+    std::vector<float> four = std::vector<float>(4 * block * Lanes);
+
+    void clear(size_t lane) {
+        first.clear(lane);
+        second.clear(lane);
+    }
+
+    // frames an input still affects the output for
+    size_t memory(const ShaperShape &shape) const {
+        if (!shape.drive || shape.oversample < 2) {
+            return 0;
+        }
+        return 4 * first.half - 2 + (shape.oversample < 4 ? 0 : 2 * second.half - 1);
+    }
+
+    // full scale in stays full scale out whatever the drive
+    static void shape(const ShaperShape &shape, float *data, size_t count) {
+        auto drive = shape.drive;
+        if (shape.curve == ShaperCurve::Tanh) {
+            auto gain = 1.0f / fast_tanh(drive);
+            for (size_t i = 0; i < count; i++) {
+                data[i] = fast_tanh(data[i] * drive) * gain;
+            }
+        } else {
+            auto cubic = [](float x) {
+                x = std::clamp(x, -1.0f, 1.0f);
+                return x * (1.5f - 0.5f * x * x);
+            };
+            auto gain = 1.0f / cubic(drive);
+            for (size_t i = 0; i < count; i++) {
+                data[i] = cubic(data[i] * drive) * gain;
+            }
+        }
+    }
+
+    void process(const ShaperShape &shape, float *data, size_t count) {
+        for (size_t begin = 0; begin < count; begin += block) {
+            auto n = std::min(count - begin, block);
+            auto frames = data + begin * Lanes;
+            if (shape.oversample < 2) {
+                Shaper::shape(shape, frames, n * Lanes);
+            } else if (shape.oversample < 4) {
+                first.upsample(frames, twice.data(), n);
+                Shaper::shape(shape, twice.data(), 2 * n * Lanes);
+                first.downsample(twice.data(), frames, n);
+            } else {
+                first.upsample(frames, twice.data(), n);
+                second.upsample(twice.data(), four.data(), 2 * n);
+                Shaper::shape(shape, four.data(), 4 * n * Lanes);
+                second.downsample(four.data(), twice.data(), 2 * n);
+                first.downsample(twice.data(), frames, n);
+            }
+        }
+    }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Rendered audio published to other local processes through a POSIX shared
+// memory object (shm_open). One writer (the synth), any number of readers.
+//
+// Layout of the object, native endian:
+//
+//   ShmRingHeader                      128 bytes, see below
+//   block[0] .. block[block_count - 1] each ShmRingBlock::size(header) bytes
+//
+//   ShmRingBlock:
+//     uint64_t sequence   index of the block in this slot, ~0 while writing
+//     uint64_t time       writer's sample clock at the first frame
+//     int16_t  samples[block_frames * channels]   interleaved
+//
+// Publishing block n: writer sets slot[n % block_count].sequence = ~0,
+// fills time and samples, stores sequence = n (release), then stores
+// write_index = n + 1 (release), increments notify and wakes its waiters.
+//
+// Reading block n in place: load sequence (acquire), use the samples, load
+// sequence again; the data was intact if both loads returned n. Blocks
+// older than write_index - block_count have been overwritten.
+//
+// Latency: a reader that keeps up with write_index sees each block one
+// block_frames / sample_rate after its first sample was rendered; the
+// ring holds block_count blocks of history.
+//
+// Notification: on Linux readers wait on notify with a shared futex
+// (FUTEX_WAIT on its address in the mapping, not FUTEX_PRIVATE), and the
+// writer wakes all of them after every block. Nothing is consumed, so no
+// reader can take another's wakeup, and a read only mapping is enough.
+// Elsewhere readers check write_index every millisecond.
+//
+// The object is created exclusively. One left by a writer that is no
+// longer running (writer_pid) is removed first; one whose writer is still
+// running, or that isn't a ring, is left alone and create fails.
+
+constexpr uint32_t shm_ring_magic = 0x524e5953; // "SYNR"
+constexpr uint32_t shm_ring_version = 2;
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t block_frames;
+    uint32_t block_count;
+    int32_t writer_pid;
+    uint8_t pad0[36];
+    std::atomic<uint64_t> write_index;
+    std::atomic<uint32_t> notify;
+    uint8_t pad1[52];
+};
+static_assert(sizeof(ShmRingHeader) == 128);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free);
+
+struct ShmRingBlock {
+    std::atomic<uint64_t> sequence;
+    uint64_t time;
+    int16_t samples[];
+
+    static size_t size(const ShmRingHeader &header) {
+        auto bytes = sizeof(ShmRingBlock) +
+            header.block_frames * header.channels * sizeof(int16_t);
+        return (bytes + 63) & ~size_t(63);
+    }
+};
+
+inline size_t shm_ring_size(const ShmRingHeader &header) {
+    return sizeof(ShmRingHeader) + header.block_count * ShmRingBlock::size(header);
+}
+
+inline ShmRingBlock *shm_ring_block(ShmRingHeader *header, uint64_t index) {
+    auto base = reinterpret_cast<uint8_t *>(header + 1);
+    auto slot = index % header->block_count;
+    return reinterpret_cast<ShmRingBlock *>(base + slot * ShmRingBlock::size(*header));
+}
+
+// A futex on a word of the shared mapping, so it works across processes.
+inline void shm_ring_wait(std::atomic<uint32_t> &word, uint32_t seen) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, seen, nullptr, nullptr, 0);
+#else
+    (void)word;
+    (void)seen;
+    usleep(1000);
+#endif
+}
+
+inline void shm_ring_wake(std::atomic<uint32_t> &word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+// Removes shm_name if it is a ring whose writer has exited, false if it
+// is anything else.
+inline bool shm_ring_remove_stale(const char *shm_name) {
+    auto fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+    struct stat info;
+    auto mem = fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(ShmRingHeader) ?
+        mmap(nullptr, sizeof(ShmRingHeader), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("%s exists and is not a synth ring\n", shm_name);
+        return false;
+    }
+    auto header = static_cast<const ShmRingHeader *>(mem);
+    auto ring = header->magic == shm_ring_magic;
+    auto pid = header->writer_pid;
+    munmap(mem, sizeof(ShmRingHeader));
+    if (!ring) {
+        printf("%s exists and is not a synth ring\n", shm_name);
+        return false;
+    }
+    if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+        printf("%s is in use by pid %d\n", shm_name, pid);
+        return false;
+    }
+    printf("removing %s, left by pid %d\n", shm_name, pid);
+    return shm_unlink(shm_name) == 0 || errno == ENOENT;
+}
+
+struct ShmRing {
+    std::string name;
+    ShmRingHeader *header = nullptr;
+    size_t size = 0;
+
+    bool create(const char *shm_name, uint32_t sample_rate, uint32_t channels,
+                uint32_t block_frames, uint32_t block_count) {
+        auto fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 && errno == EEXIST && shm_ring_remove_stale(shm_name)) {
+            fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        }
+        if (fd < 0) {
+            if (errno != EEXIST) {
+                printf("couldn't create shared memory %s\n", shm_name);
+            }
+            return false;
+        }
+        auto layout = ShmRingHeader();
+        layout.channels = channels;
+        layout.block_frames = block_frames;
+        layout.block_count = block_count;
+        size = shm_ring_size(layout);
+        if (ftruncate(fd, size) < 0) {
+            printf("couldn't size shared memory %s\n", shm_name);
+            close(fd);
+            shm_unlink(shm_name);
+            return false;
+        }
+        auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            printf("couldn't map shared memory %s\n", shm_name);
+            shm_unlink(shm_name);
+            return false;
+        }
+        name = shm_name;
+        memset(mem, 0, size);
+        header = new (mem) ShmRingHeader();
+        header->sample_rate = sample_rate;
+        header->channels = channels;
+        header->block_frames = block_frames;
+        header->block_count = block_count;
+        header->writer_pid = getpid();
+        header->version = shm_ring_version;
+        for (uint32_t i = 0; i < block_count; i++) {
+            shm_ring_block(header, i)->sequence.store(~0ull, std::memory_order_relaxed);
+        }
+        header->write_index.store(0, std::memory_order_relaxed);
+        header->notify.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = shm_ring_magic;
+        return true;
+    }
+
+    // count may be less than a whole block, the remainder is zero filled.
+    // time is the writer's clock at the first frame.
+    void write(const int16_t *data, size_t count, uint64_t time) {
+        auto index = header->write_index.load(std::memory_order_relaxed);
+        auto block = shm_ring_block(header, index);
+        auto samples = size_t(header->block_frames) * header->channels;
+        count = std::min(count, samples);
+        block->sequence.store(~0ull, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        block->time = time;
+        std::copy(data, data + count, block->samples);
+        std::fill(block->samples + count, block->samples + samples, 0);
+        block->sequence.store(index, std::memory_order_release);
+        header->write_index.store(index + 1, std::memory_order_release);
+        header->notify.fetch_add(1, std::memory_order_release);
+        shm_ring_wake(header->notify);
+    }
+
+    ~ShmRing() {
+        if (header) {
+            munmap(header, size);
+            shm_unlink(name.c_str());
+        }
+    }
+};
+
+struct ShmRingReader {
+    ShmRingHeader *header = nullptr;
+    size_t size = 0;
+    uint64_t read_index = 0;
+
+    bool open(const char *shm_name) {
+        auto fd = shm_open(shm_name, O_RDONLY, 0);
+        if (fd < 0) {
+            printf("couldn't open shared memory %s\n", shm_name);
+            return false;
+        }
+        auto mem = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        auto mapped = static_cast<ShmRingHeader *>(mem);
+        auto valid = mapped->magic == shm_ring_magic && mapped->version == shm_ring_version;
+        size = shm_ring_size(*mapped);
+        munmap(mem, sizeof(ShmRingHeader));
+        if (!valid) {
+            printf("%s is not a synth ring\n", shm_name);
+            close(fd);
+            return false;
+        }
+        mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        header = static_cast<ShmRingHeader *>(mem);
+        read_index = header->write_index.load(std::memory_order_acquire);
+        return true;
+    }
+
+    // Blocks until at least one unread block is available. notify is read
+    // before write_index, so a block published in between changes it and
+    // the futex returns at once rather than sleeping through the wakeup.
+    void wait() {
+        while (true) {
+            auto seen = header->notify.load(std::memory_order_acquire);
+            if (read_index < header->write_index.load(std::memory_order_acquire)) {
+                return;
+            }
+            shm_ring_wait(header->notify, seen);
+        }
+    }
+
+    // Returns the next unread block, skipping any that were overwritten, or
+    // nullptr if the reader is up to date.
+    const ShmRingBlock *next() {
+        while (true) {
+            auto write = header->write_index.load(std::memory_order_acquire);
+            if (write - read_index > header->block_count) {
+                read_index = write - header->block_count;
+            }
+            if (read_index >= write) {
+                return nullptr;
+            }
+            auto block = shm_ring_block(header, read_index);
+            if (block->sequence.load(std::memory_order_acquire) == read_index) {
+                read_index++;
+                return block;
+            }
+            read_index = write - header->block_count + 1;
+        }
+    }
+
+    // True if block still holds the data it had when next() returned it.
+    bool intact(const ShmRingBlock *block) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return block->sequence.load(std::memory_order_relaxed) == read_index - 1;
+    }
+
+    ~ShmRingReader() {
+        if (header) {
+            munmap(header, size);
+        }
+    }
+};
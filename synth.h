@@ -0,0 +1,1231 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+#endif
+
+#include "dispatch.h"
+#include "drums.h"
+#include "dynamics.h"
+#include "effects.h"
+#include "envelope.h"
+#include "equalizer.h"
+#include "filters.h"
+#include "fm.h"
+#include "modulation.h"
+#include "noise.h"
+#include "sampler.h"
+#include "shaper.h"
+#include "wavetable.h"
+
+constexpr size_t buffer_size = 1024;
+constexpr unsigned samples_per_sec = 44100;
+constexpr size_t max_voices = 8;
+constexpr size_t channels = 2;
+// phase increments by MIDI note, at tuning 1
+constexpr NoteTable<samples_per_sec> note_table;
+
+// Turns on flush-to-zero and denormals-are-zero for the calling thread while
+// in scope, so filter states decaying towards silence never go subnormal.
+struct FlushDenormals {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned saved = _mm_getcsr();
+    FlushDenormals() {
+        _mm_setcsr(saved | 0x8040);
+    }
+    ~FlushDenormals() {
+        _mm_setcsr(saved);
+    }
+#elif defined(__aarch64__)
+    uint64_t saved = fpcr();
+    FlushDenormals() {
+        set_fpcr(saved | (1 << 24));
+    }
+    ~FlushDenormals() {
+        set_fpcr(saved);
+    }
+    static uint64_t fpcr() {
+        uint64_t value;
+        asm volatile("mrs %0, fpcr" : "=r"(value));
+        return value;
+    }
+    static void set_fpcr(uint64_t value) {
+        asm volatile("msr fpcr, %0" : : "r"(value));
+    }
+#endif
+};
+
+constexpr uint64_t ticks_per_beat = 960;
+constexpr uint64_t max_loop_samples = 60 * samples_per_sec;
+
+struct MusicalTime {
+    uint64_t bar;
+    uint32_t beat;
+    uint32_t tick;
+};
+
+// count detuned saws per voice, detune cents between the outermost two,
+// spread from 0 (all centred) to 1 (outermost hard left and right).
+struct Unison {
+    static constexpr size_t max_count = 8;
+    size_t count = 1;
+    float detune = 20;
+    float spread = 0.5f;
+    bool operator==(const Unison &) const = default;
+};
+
+enum class Oscillator {
+    SawTooth,
+    Fm,
+    Wavetable,
+    Sampler,
+    Noise,
+};
+
+// The sound, as opposed to what is played with it.
+struct Patch {
+    Oscillator oscillator = Oscillator::SawTooth;
+    Unison unison;
+    FmShape fm = FmShape::algorithm(FmAlgorithm::Pairs, 4);
+    std::shared_ptr<const WavetableBank> wavetable;
+    float wave_position = 0;
+    std::shared_ptr<SampleLibrary> samples;
+    NoiseColor noise = NoiseColor::White;
+    FilterType filter = FilterType::LowPass;
+    SvfMode svf_mode = SvfMode::LowPass;
+    float cutoff = 4800;
+    float resonance = 0;
+    ShaperShape drive;
+    EqShape eq;
+    EnvelopeShape amp = EnvelopeShape::adsr(0.005f, 0.2f, 0.7f, 0.15f);
+    ModMatrix mod;
+    EffectsShape effects;
+    std::shared_ptr<const ImpulseResponse> impulse;
+    EqShape master_eq;
+    DynamicsShape dynamics;
+    DrumShape drums;
+};
+
+struct Synth {
+    // the sample clock, everything else is derived from it
+    uint64_t t = 0;
+    uint64_t block_time = 0;
+
+    // Musical position is computed from the sample clock in whole ticks
+    // rather than accumulated, so no rounding builds up however long the
+    // clock runs. A tempo change re-anchors the conversion where it happens.
+    struct Sequencer {
+        int bpm = 138;
+        int steps_per_beat = 4;
+        int beats_per_bar = 4;
+        float pattern[8] = {440, 0,  698.5, 400, 554.4, 698.5, 830.6, 554.4};
+        float velocity[8] = {1, 1, 1, 1, 1, 1, 1, 1};
+        uint64_t anchor_sample = 0;
+        uint64_t anchor_ticks = 0;
+
+        uint64_t ticks_per_step() const {
+            return ticks_per_beat / steps_per_beat;
+        }
+        uint64_t tick_rate() const {
+            return bpm * ticks_per_beat;
+        }
+        uint64_t sample_rate() const {
+            return 60 * samples_per_sec;
+        }
+        uint64_t ticks(uint64_t sample) const {
+            if (sample >= anchor_sample) {
+                return anchor_ticks + (sample - anchor_sample) * tick_rate() / sample_rate();
+            }
+            auto back = ((anchor_sample - sample) * tick_rate() + sample_rate() - 1) / sample_rate();
+            return back > anchor_ticks ? 0 : anchor_ticks - back;
+        }
+        // samples in a step, rounded up
+        uint64_t step_length() const {
+            return (ticks_per_step() * sample_rate() + tick_rate() - 1) / tick_rate();
+        }
+        // first sample at or after ticks
+        uint64_t sample_at(uint64_t ticks) const {
+            if (ticks >= anchor_ticks) {
+                return anchor_sample + ((ticks - anchor_ticks) * sample_rate() + tick_rate() - 1) / tick_rate();
+            }
+            auto back = (anchor_ticks - ticks) * sample_rate() / tick_rate();
+            return back > anchor_sample ? 0 : anchor_sample - back;
+        }
+        void set_bpm(int new_bpm, uint64_t sample) {
+            anchor_ticks = ticks(sample);
+            anchor_sample = sample;
+            bpm = new_bpm;
+        }
+        MusicalTime musical_time(uint64_t sample) const {
+            auto now = ticks(sample);
+            auto beats = now / ticks_per_beat;
+            return {beats / beats_per_bar,
+                    static_cast<uint32_t>(beats % beats_per_bar),
+                    static_cast<uint32_t>(now % ticks_per_beat)};
+        }
+        uint64_t step(uint64_t sample) const {
+            return ticks(sample) / ticks_per_step();
+        }
+        uint64_t next_step(uint64_t sample) const {
+            return sample_at((step(sample) + 1) * ticks_per_step());
+        }
+        float note(uint64_t sample) const {
+            return pattern[step(sample) % 8];
+        }
+        // whether a note starts in [from, to)
+        bool plays(uint64_t from, uint64_t to) const {
+            for (auto position = from; position < to; position = next_step(position)) {
+                if (sample_at(step(position) * ticks_per_step()) == position && note(position)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // whether a step with any of drums starts in [from, to)
+        bool hits(uint64_t from, uint64_t to, const uint8_t *drums) const {
+            for (auto position = from; position < to; position = next_step(position)) {
+                auto at = step(position);
+                if (sample_at(at * ticks_per_step()) == position && drums[at % 8]) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // samples after which the rendered notes repeat exactly, a whole
+        // number of patterns that is also a whole number of samples
+        uint64_t loop_length() const {
+            auto pattern_ticks = 8 * ticks_per_step();
+            auto scaled = pattern_ticks * sample_rate();
+            return scaled / std::gcd(scaled, tick_rate());
+        }
+    } sequencer;
+
+    // One saw per voice, all voices stepped together in
+    // [sample * max_voices + voice] blocks. The phase restarts on every note.
+    // delta is the increment for the note, speed the one in use after pitch
+    // modulation, changing by accel every sample.
+    //
+    // In unison each voice is unison.count saws at ratio[c] times the speed,
+    // starting at random phases seeded by the note's step in the pattern, so
+    // every pass of the pattern, and so a seek or the loop cache, hears the
+    // same ones. A voice's copies sit side by side in copies[voice], every
+    // slot stepped together, with gains of 0 past unison.count, so one
+    // vector steps them all; only the voices in live are rendered, the
+    // rest give silence. Spread copies also add to a side signal, + left
+    // and - right.
+    struct SawTooth {
+        std::atomic<float> tuning_v = 1.0f;
+        float tuning = 1.0;
+        float volume = 0.25;
+        float note[max_voices] = {};
+        float phase[max_voices] = {};
+        float delta[max_voices] = {};
+        float speed[max_voices] = {};
+        float accel[max_voices] = {};
+        Unison unison;
+        bool live[max_voices] = {};
+        float copies[max_voices][Unison::max_count] = {};
+        float ratio[Unison::max_count] = {1};
+        float mid_gain[Unison::max_count] = {};
+        float side_gain[Unison::max_count] = {};
+
+        void set_unison(const Unison &new_unison) {
+            unison = new_unison;
+            unison.count = std::clamp<size_t>(unison.count, 1, Unison::max_count);
+            auto n = unison.count;
+            auto gain = volume / std::sqrt(float(n));
+            for (size_t c = 0; c < Unison::max_count; c++) {
+                auto at = n > 1 ? 2.0f * c / (n - 1) - 1.0f : 0.0f;
+                ratio[c] = c < n ? std::exp2(at * unison.detune / 2400) : 1.0f;
+                mid_gain[c] = c < n ? gain : 0.0f;
+                side_gain[c] = c < n ? at * std::clamp(unison.spread, 0.0f, 1.0f) * gain : 0.0f;
+            }
+        }
+        bool spreading() const {
+            return unison.count > 1 && unison.spread > 0;
+        }
+        float delta_for(float hz) const {
+            if (!hz) {
+                return 0;
+            }
+            auto freq = std::clamp(tuning * hz, 10.0f, 10000.0f);
+            return freq * (2.0f / samples_per_sec);
+        }
+        void control() {
+            auto last = tuning;
+            tuning = std::clamp(tuning * tuning_v, 0.1f, 1000.0f);
+            if (tuning != last) {
+                for (size_t v = 0; v < max_voices; v++) {
+                    delta[v] = delta_for(note[v]);
+                    speed[v] = delta[v];
+                }
+            }
+        }
+        void unmodulate() {
+            std::copy(std::begin(delta), std::end(delta), speed);
+            std::fill(std::begin(accel), std::end(accel), 0.0f);
+        }
+        void start(size_t voice, float hz, uint64_t seed) {
+            note[voice] = hz;
+            phase[voice] = 0;
+            live[voice] = true;
+            auto state = seed * 0x9e3779b97f4a7c15ull;
+            for (size_t c = 0; c < Unison::max_count; c++) {
+                state = state * 6364136223846793005ull + 1442695040888963407ull;
+                copies[voice][c] = (state >> 40) * (2.0f / (1u << 24)) - 1.0f;
+            }
+            delta[voice] = delta_for(hz);
+            speed[voice] = delta[voice];
+            accel[voice] = 0;
+        }
+        void skip(size_t voice, uint64_t n) {
+            phase[voice] = std::fmod(phase[voice] + 1.0 + static_cast<double>(n) * delta[voice], 2.0) - 1.0;
+            for (size_t c = 0; c < unison.count; c++) {
+                auto &p = copies[voice][c];
+                p = std::fmod(p + 1.0 + static_cast<double>(n) * (delta[voice] * ratio[c]), 2.0) - 1.0;
+            }
+        }
+        // side, if given, receives the spread copies
+        void render(float *lanes, float *side, size_t count) {
+            if (unison.count > 1) {
+                render_unison(lanes, side, count);
+                return;
+            }
+            for (size_t i = 0; i < count; i++) {
+                float *frame = lanes + i * max_voices;
+                for (size_t v = 0; v < max_voices; v++) {
+                    frame[v] = phase[v] * volume;
+                    phase[v] += speed[v];
+                    speed[v] += accel[v];
+                    phase[v] -= phase[v] > 1.0f ? 2.0f : 0.0f;
+                }
+            }
+        }
+        void render_unison(float *lanes, float *side, size_t count) {
+            float rate[Unison::max_count];
+            float mid_gains[Unison::max_count];
+            float side_gains[Unison::max_count];
+            std::copy(std::begin(ratio), std::end(ratio), rate);
+            std::copy(std::begin(mid_gain), std::end(mid_gain), mid_gains);
+            std::copy(std::begin(side_gain), std::end(side_gain), side_gains);
+            for (size_t v = 0; v < max_voices; v++) {
+                if (!live[v]) {
+                    for (size_t i = 0; i < count; i++) {
+                        lanes[i * max_voices + v] = 0;
+                        if (side) {
+                            side[i * max_voices + v] = 0;
+                        }
+                    }
+                    continue;
+                }
+                float p[Unison::max_count];
+                std::copy(std::begin(copies[v]), std::end(copies[v]), p);
+                auto s = speed[v];
+                for (size_t i = 0; i < count; i++) {
+                    float mid[Unison::max_count];
+                    float wide[Unison::max_count];
+                    for (size_t c = 0; c < Unison::max_count; c++) {
+                        mid[c] = p[c] * mid_gains[c];
+                        wide[c] = p[c] * side_gains[c];
+                        // a copy steps less than 1, so truncating finds
+                        // the wrap without a branch the vectoriser refuses
+                        auto q = p[c] + s * rate[c];
+                        p[c] = q - 2.0f * static_cast<int>(q);
+                    }
+                    lanes[i * max_voices + v] = sum(mid);
+                    if (side) {
+                        side[i * max_voices + v] = sum(wide);
+                    }
+                    s += accel[v];
+                }
+                std::copy(p, p + Unison::max_count, copies[v]);
+                speed[v] = s;
+            }
+        }
+        // pairwise, so the halves add as vectors
+        static float sum(const float *x) {
+            static_assert(Unison::max_count == 8);
+            float half[4];
+            for (size_t c = 0; c < 4; c++) {
+                half[c] = x[c] + x[c + 4];
+            }
+            return (half[0] + half[2]) + (half[1] + half[3]);
+        }
+    } sawtooth;
+
+    Oscillator oscillator = Oscillator::SawTooth;
+    Fm<max_voices> fm;
+    Wavetable<max_voices> wavetable;
+    float wave_position = 0;
+    Sampler<max_voices> sampler;
+    Noise<max_voices> noise;
+    DrumKit drums = DrumKit(samples_per_sec);
+    Envelope<max_voices> envelope = Envelope<max_voices>(samples_per_sec);
+    Modulation<max_voices> modulation;
+    Effects effects = Effects(samples_per_sec);
+    Equalizer<channels> master_eq = Equalizer<channels>(samples_per_sec);
+    Dynamics dynamics = Dynamics(samples_per_sec);
+    uint64_t started[max_voices] = {};
+    float velocity[max_voices] = {};
+    int held = -1;
+
+    void note_off() {
+        if (held >= 0) {
+            envelope.gate_off(held);
+            held = -1;
+        }
+    }
+
+    // A new note takes an idle voice, or else the one started longest ago.
+    void note_on(float note, float note_velocity, uint64_t now) {
+        note_off();
+        if (!note) {
+            return;
+        }
+        size_t voice = 0;
+        for (size_t v = 0; v < max_voices; v++) {
+            if (!envelope.active(v)) {
+                voice = v;
+                break;
+            }
+            if (started[v] < started[voice]) {
+                voice = v;
+            }
+        }
+        started[voice] = now;
+        sleeping[voice] = false;
+        held = voice;
+        velocity[voice] = note_velocity;
+        sawtooth.start(voice, note, sequencer.step(now) % 8);
+        fm.start(voice);
+        wavetable.start(voice);
+        sampler.start(voice, note);
+        noise.start(voice, sequencer.step(now) % 8);
+        envelope.gate_on(voice);
+        modulation.restart(voice);
+    }
+
+    // moves every voice on by n samples without rendering
+    void skip_voices(uint64_t n) {
+        for (size_t v = 0; v < max_voices; v++) {
+            if (envelope.active(v)) {
+                envelope.skip(v, n);
+                sawtooth.skip(v, n);
+                fm.skip(v, n, sawtooth.delta[v]);
+                wavetable.skip(v, n, sawtooth.delta[v]);
+                sampler.skip(v, n, sawtooth.delta[v]);
+                noise.skip(v, n);
+            }
+        }
+    }
+
+    // Cutoff and resonance for whichever filter is selected. The cutoff is
+    // smoothed every control_block samples; the filters only recompute
+    // their coefficients when the smoothed value moves.
+    struct FilterControl {
+        static constexpr size_t control_block = 32;
+        std::atomic<FilterType> type = FilterType::LowPass;
+        std::atomic<SvfMode> svf_mode = SvfMode::LowPass;
+        std::atomic<float> cutoff_v = 1.0;
+        std::atomic<float> cutoff = 4800;
+        std::atomic<float> resonance = 0;
+        float smoothed = 4800;
+        void control() {
+            cutoff = std::clamp(cutoff * cutoff_v, 10.0f, max_cutoff(samples_per_sec));
+        }
+        void smooth() {
+            float target = cutoff;
+            smoothed += (target - smoothed) * 0.1f;
+            if (std::abs(target - smoothed) < target * 1e-3f) {
+                smoothed = target;
+            }
+        }
+        bool settled() const {
+            return smoothed == cutoff && cutoff_v == 1.0f;
+        }
+        // samples until a step on the input has settled to within 0.1%
+        size_t settle_length() const {
+            auto w = 2 * static_cast<float>(M_PI) * smoothed / samples_per_sec;
+            auto n = 4 * std::log(1e3f) / w / (1.0f - 0.96f * std::clamp(resonance.load(), 0.0f, 0.99f));
+            return std::min(static_cast<size_t>(n) + 1, size_t(16384));
+        }
+    } filter;
+
+    // voices filters the voice lanes; side filters the unison side signal
+    // with the same coefficients, only while unison is spread
+    FilterBank<max_voices> voices = FilterBank<max_voices>(samples_per_sec);
+    FilterBank<max_voices> side_voices = FilterBank<max_voices>(samples_per_sec);
+    FilterType active_filter = FilterType::LowPass;
+    std::atomic<uint64_t> denormals = 0;
+
+    // A voice sleeps once its envelope is idle and its filter has rung out
+    // below half a bit; while every voice sleeps and no note starts, blocks
+    // skip the voice DSP altogether. Turning sleep_voices off keeps every
+    // block rendered, as the benchmark of a decaying filter needs.
+    static constexpr float silence = 0.5f / SHRT_MAX;
+    bool sleep_voices = true;
+    bool sleeping[max_voices] = {true, true, true, true, true, true, true, true};
+    std::atomic<uint64_t> skipped_blocks = 0;
+
+    bool asleep() const {
+        return std::all_of(std::begin(sleeping), std::end(sleeping), [](bool s) { return s; });
+    }
+
+    // puts the voices that went quiet during the last count samples to sleep
+    void doze(const float *lanes, const float *side, size_t count) {
+        for (size_t v = 0; v < max_voices; v++) {
+            if (sleeping[v] || envelope.active(v)) {
+                continue;
+            }
+            float peak = 0;
+            for (size_t i = 0; i < count; i++) {
+                peak = std::max(peak, std::abs(lanes[i * max_voices + v]));
+                if (side) {
+                    peak = std::max(peak, std::abs(side[i * max_voices + v]));
+                }
+            }
+            if (peak < silence) {
+                voices.prime(v, 0);
+                side_voices.prime(v, 0);
+                shaper.clear(v);
+                side_shaper.clear(v);
+                eq.clear(v);
+                side_eq.clear(v);
+                sleeping[v] = true;
+            }
+        }
+    }
+
+    void prime_filter(size_t voice, float level) {
+        voices.prime(voice, level);
+        side_voices.prime(voice, 0);
+        shaper.clear(voice);
+        side_shaper.clear(voice);
+        eq.clear(voice);
+        side_eq.clear(voice);
+        sleeping[voice] = level == 0 && !envelope.active(voice);
+    }
+
+    void prime_filter(float level) {
+        for (size_t v = 0; v < max_voices; v++) {
+            prime_filter(v, level);
+        }
+    }
+
+    // cutoff, if given, is a per sample cutoff in Hz for each voice; side,
+    // if given, is filtered alongside lanes
+    void apply_filter(float *lanes, float *side, size_t count, const float *cutoff) {
+        auto type = filter.type.load();
+        if (type != active_filter && count) {
+            active_filter = type;
+            for (size_t v = 0; v < max_voices; v++) {
+                voices.prime(v, lanes[v]);
+                side_voices.prime(v, side ? side[v] : 0);
+            }
+        }
+        voices.svf.mode = filter.svf_mode;
+        side_voices.svf.mode = filter.svf_mode;
+        float resonance = filter.resonance;
+        for (size_t begin = 0; begin < count; begin += FilterControl::control_block) {
+            auto n = std::min(count - begin, FilterControl::control_block);
+            auto modulation = cutoff ? cutoff + begin * max_voices : nullptr;
+            filter.smooth();
+            for (size_t v = 0; v < max_voices; v++) {
+                voices.set(type, v, filter.smoothed, resonance);
+            }
+            voices.process(type, lanes + begin * max_voices, n, modulation);
+            if (side) {
+                for (size_t v = 0; v < max_voices; v++) {
+                    side_voices.set(type, v, filter.smoothed, resonance);
+                }
+                side_voices.process(type, side + begin * max_voices, n, modulation);
+            }
+        }
+        denormals += voices.denormals(type);
+    }
+
+    // drive saturates every voice before or after the filter; a spread
+    // unison is shaped as left and right rather than as mid and side
+    ShaperShape drive;
+    Shaper<max_voices> shaper;
+    Shaper<max_voices> side_shaper;
+
+    // the patch's EQ on every voice, and on the side signal while unison
+    // is spread
+    Equalizer<max_voices> eq = Equalizer<max_voices>(samples_per_sec);
+    Equalizer<max_voices> side_eq = Equalizer<max_voices>(samples_per_sec);
+
+    void set_drive(const ShaperShape &shape) {
+        if (!(shape.drive && drive.drive && shape.oversample == drive.oversample)) {
+            for (size_t v = 0; v < max_voices; v++) {
+                shaper.clear(v);
+                side_shaper.clear(v);
+            }
+        }
+        drive = shape;
+    }
+
+    void apply_drive(float *lanes, float *side, size_t count) {
+        if (!drive.drive) {
+            return;
+        }
+        if (!side) {
+            shaper.process(drive, lanes, count);
+            return;
+        }
+        for (size_t i = 0; i < count * max_voices; i++) {
+            auto mid = lanes[i];
+            lanes[i] = mid + side[i];
+            side[i] = mid - side[i];
+        }
+        shaper.process(drive, lanes, count);
+        side_shaper.process(drive, side, count);
+        for (size_t i = 0; i < count * max_voices; i++) {
+            auto left = lanes[i];
+            lanes[i] = 0.5f * (left + side[i]);
+            side[i] = 0.5f * (left - side[i]);
+        }
+    }
+
+    // Once nothing has changed and the filter has settled, one loop_length
+    // of output is recorded and then played back instead of rendering.
+    // Recording starts on a step boundary so the loop seam falls on a note.
+    struct LoopCache {
+        struct Key {
+            float pattern[8];
+            int bpm;
+            int steps_per_beat;
+            uint64_t anchor_sample;
+            uint64_t anchor_ticks;
+            float tuning;
+            EnvelopeShape amp;
+            FilterType filter;
+            SvfMode svf_mode;
+            float cutoff;
+            float resonance;
+            ModMatrix mod;
+            Oscillator oscillator;
+            FmShape fm;
+            const WavetableBank *wavetable;
+            float wave_position;
+            const SampleLibrary *samples;
+            Unison unison;
+            NoiseColor noise;
+            ShaperShape drive;
+            EqShape eq;
+            EffectsShape effects;
+            const ImpulseResponse *impulse;
+            EqShape master_eq;
+            DynamicsShape dynamics;
+            DrumShape drums;
+            Isa isa;
+            bool operator==(const Key &) const = default;
+        };
+        Key key = {};
+        // the longest loop's worth, handed over by load() so recording never
+        // allocates on the render thread; the loop is the first length frames
+        std::vector<int16_t> samples;
+        uint64_t length = 0;
+        size_t settled = 0;
+        size_t recorded = 0;
+        bool replaying = false;
+
+        bool ready() const {
+            return length && recorded >= length * channels;
+        }
+
+        void restart() {
+            settled = 0;
+            recorded = 0;
+        }
+
+        void play(uint64_t position, int16_t *data, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                auto frame = &samples[(position + i) % length * channels];
+                std::copy(frame, frame + channels, data + i * channels);
+            }
+            replaying = true;
+        }
+
+        // boundary is the offset of the first step start in data, or count
+        void update(const Key &now, uint64_t loop_length, size_t settle, uint64_t position,
+                    size_t boundary, const int16_t *data, size_t count) {
+            if (!(now == key) || length != loop_length) {
+                key = now;
+                length = loop_length;
+                restart();
+                return;
+            }
+            if (settled < settle) {
+                settled += count;
+                return;
+            }
+            auto begin = recorded ? 0 : boundary;
+            for (size_t i = begin; i < count && recorded < length * channels; i++, recorded += channels) {
+                auto frame = data + i * channels;
+                std::copy(frame, frame + channels, &samples[(position + i) % length * channels]);
+            }
+        }
+    } loop;
+
+    LoopCache::Key loop_key() const {
+        auto key = LoopCache::Key();
+        std::copy(std::begin(sequencer.pattern), std::end(sequencer.pattern), key.pattern);
+        key.bpm = sequencer.bpm;
+        key.steps_per_beat = sequencer.steps_per_beat;
+        key.anchor_sample = sequencer.anchor_sample;
+        key.anchor_ticks = sequencer.anchor_ticks;
+        key.tuning = sawtooth.tuning;
+        key.amp = envelope.shape;
+        key.filter = filter.type;
+        key.svf_mode = filter.svf_mode;
+        key.cutoff = filter.smoothed;
+        key.resonance = filter.resonance;
+        key.mod = modulation.matrix;
+        key.oscillator = oscillator;
+        key.fm = fm.shape;
+        key.wavetable = wavetable.bank.get();
+        key.wave_position = wave_position;
+        key.samples = sampler.library.get();
+        key.unison = sawtooth.unison;
+        key.noise = noise.color;
+        key.drive = drive;
+        key.eq = eq.shape;
+        key.effects = effects.shape;
+        key.master_eq = master_eq.shape;
+        key.dynamics = dynamics.shape;
+        key.drums = drums.shape;
+        key.isa = isa;
+        key.impulse = effects.convolution.convolver ? effects.convolution.convolver->ir.get() : nullptr;
+        return key;
+    }
+
+    // LFOs do not repeat with the pattern
+    bool cacheable() const {
+        auto &matrix = modulation.matrix;
+        return cache_loops && !loop.samples.empty() && !matrix.uses(ModSource::Lfo1) &&
+            !matrix.uses(ModSource::Lfo2) && effects.periodic();
+    }
+
+    // off before the first load, the loop cache's 10 MB is never allocated
+    bool cache_loops = true;
+    // Live playback, which never waits for the convolver's worker. A seek's
+    // lead-in still does, and the loop cache only keeps what was rendered
+    // without a late block, so both match a render that waited.
+    bool realtime = false;
+    // the instruction set render runs on
+    std::atomic<Isa> isa = Isa::Default;
+    std::atomic<bool> playing = true;
+    std::atomic<int64_t> seek_to = -1;
+    std::atomic<int> bpm_to = 0;
+
+    std::array<float, buffer_size * max_voices> lanes;
+    std::array<float, buffer_size * max_voices> amp;
+    std::array<float, buffer_size * max_voices> cutoff_mod;
+    std::array<float, buffer_size * max_voices> pan_left;
+    std::array<float, buffer_size * max_voices> pan_right;
+    std::array<float, buffer_size * max_voices> side;
+    std::array<float, buffer_size * channels> mix;
+
+    static void pan_gains(float pan, float &left, float &right) {
+        auto angle = (std::clamp(pan, -1.0f, 1.0f) + 1.0f) * static_cast<float>(M_PI) / 4;
+        left = std::cos(angle) * static_cast<float>(M_SQRT2);
+        right = std::sin(angle) * static_cast<float>(M_SQRT2);
+    }
+
+    // Evaluates the matrix at offset into the block if renew, else carries
+    // on with the ramps already running towards the end of the control
+    // block, and ramps each routed destination over the next length
+    // samples: pitch through the oscillator increments, volume into amp,
+    // cutoff and pan into their own buffers.
+    void modulate(uint64_t time, size_t offset, size_t length, bool renew) {
+        auto &matrix = modulation.matrix;
+        auto &sources = modulation.sources;
+        if (renew) {
+            auto block = std::clamp<size_t>(matrix.control_block, 1, buffer_size);
+            for (size_t l = 0; l < 2; l++) {
+                auto value = matrix.lfo[l].value(time, samples_per_sec);
+                std::fill(std::begin(sources[l]), std::end(sources[l]), value);
+            }
+            for (size_t v = 0; v < max_voices; v++) {
+                auto note = sawtooth.note[v];
+                sources[static_cast<size_t>(ModSource::Envelope)][v] = amp[offset * max_voices + v];
+                sources[static_cast<size_t>(ModSource::Velocity)][v] = velocity[v];
+                sources[static_cast<size_t>(ModSource::Key)][v] = note ? std::log2(note / 261.63f) : 0;
+            }
+            modulation.evaluate(block - time % block);
+        }
+
+        auto ramp = [&](ModDest dest, float *out, auto &&map) {
+            auto at = modulation.at(dest);
+            auto slope = modulation.slope(dest);
+            for (size_t v = 0; v < max_voices; v++) {
+                auto from = map(at[v]);
+                auto step = (map(at[v] + slope[v] * length) - from) / length;
+                for (size_t i = 0; i < length; i++) {
+                    out[(offset + i) * max_voices + v] = from + step * i;
+                }
+            }
+        };
+        if (matrix.targets(ModDest::Pitch)) {
+            auto at = modulation.at(ModDest::Pitch);
+            auto slope = modulation.slope(ModDest::Pitch);
+            for (size_t v = 0; v < max_voices; v++) {
+                auto from = sawtooth.delta[v] * fast_exp2(at[v] / 12);
+                auto to = sawtooth.delta[v] * fast_exp2((at[v] + slope[v] * length) / 12);
+                sawtooth.speed[v] = from;
+                sawtooth.accel[v] = (to - from) / length;
+            }
+        }
+        if (matrix.targets(ModDest::Volume)) {
+            auto at = modulation.at(ModDest::Volume);
+            auto slope = modulation.slope(ModDest::Volume);
+            for (size_t i = 0; i < length; i++) {
+                float *frame = amp.data() + (offset + i) * max_voices;
+                for (size_t v = 0; v < max_voices; v++) {
+                    frame[v] *= std::max(0.0f, 1.0f + at[v] + slope[v] * i);
+                }
+            }
+        }
+        if (matrix.targets(ModDest::Cutoff)) {
+            float base = filter.smoothed;
+            ramp(ModDest::Cutoff, cutoff_mod.data(), [&](float octaves) {
+                return base * fast_exp2(octaves);
+            });
+        }
+        if (matrix.targets(ModDest::Position)) {
+            auto at = modulation.at(ModDest::Position);
+            auto slope = modulation.slope(ModDest::Position);
+            for (size_t v = 0; v < max_voices; v++) {
+                wavetable.position[v] = wave_position + at[v];
+                wavetable.position_step[v] = slope[v];
+            }
+        }
+        if (matrix.targets(ModDest::Pan)) {
+            ramp(ModDest::Pan, pan_left.data(), [](float pan) {
+                float left, right;
+                pan_gains(pan, left, right);
+                return left;
+            });
+            ramp(ModDest::Pan, pan_right.data(), [](float pan) {
+                float left, right;
+                pan_gains(pan, left, right);
+                return right;
+            });
+        }
+        modulation.advance(length);
+    }
+
+    // side, if given, receives the unison saw's side signal
+    void oscillate(float *lanes, size_t count, float *side = nullptr) {
+        switch (oscillator) {
+        case Oscillator::SawTooth:
+            sawtooth.render(lanes, side, count);
+            break;
+        case Oscillator::Fm:
+            fm.render(lanes, count, sawtooth.volume, sawtooth.speed, sawtooth.accel);
+            break;
+        case Oscillator::Wavetable:
+            if (!modulation.matrix.targets(ModDest::Position)) {
+                std::fill(std::begin(wavetable.position), std::end(wavetable.position), wave_position);
+                std::fill(std::begin(wavetable.position_step), std::end(wavetable.position_step), 0.0f);
+            }
+            wavetable.render(lanes, count, sawtooth.volume, sawtooth.speed, sawtooth.accel);
+            break;
+        case Oscillator::Sampler:
+            sampler.render(lanes, count, sawtooth.volume, sawtooth.speed, sawtooth.accel);
+            break;
+        case Oscillator::Noise:
+            noise.render(lanes, count, sawtooth.volume);
+            break;
+        }
+    }
+
+    // Renders count stereo frames starting at clock position from through
+    // the voices and the drums and then the effects, on the isa path.
+    void render(uint64_t from, float *data, size_t count) {
+        run_on(isa.load(std::memory_order_relaxed), [&] {
+            render_block(from, data, count);
+        });
+    }
+
+    // Blocks in which every voice sleeps and no note starts skip the voices.
+    void render_block(uint64_t from, float *data, size_t count) {
+        if (sleep_voices && asleep() && !sequencer.plays(from, from + count)) {
+            note_off();
+            for (size_t begin = 0; begin < count; begin += FilterControl::control_block) {
+                filter.smooth();
+            }
+            std::fill(data, data + count * channels, 0.0f);
+            skipped_blocks++;
+        } else {
+            render_voices(from, data, count);
+        }
+        render_drums(from, data, count);
+        skipped_blocks += effects.process(data, count, from);
+        master_eq.process(data, count);
+        skipped_blocks += dynamics.process(data, count);
+    }
+
+    // Adds the kit to data, splitting at step boundaries so each hit lands
+    // on its exact sample. Nothing is done while no drum rings or is hit.
+    void render_drums(uint64_t from, float *data, size_t count) {
+        if (!drums.active() && !sequencer.hits(from, from + count, drums.shape.steps)) {
+            return;
+        }
+        size_t done = 0;
+        while (done < count) {
+            auto position = from + done;
+            auto step = sequencer.step(position);
+            if (sequencer.sample_at(step * sequencer.ticks_per_step()) == position) {
+                drums.hit(drums.shape.steps[step % 8], step % 8, sequencer.velocity[step % 8]);
+            }
+            auto n = std::min<uint64_t>(count - done, sequencer.next_step(position) - position);
+            drums.render(data + done * channels, n);
+            done += n;
+        }
+    }
+
+    // Renders the voices, splitting at step boundaries so each note starts
+    // on its exact sample.
+    void render_voices(uint64_t from, float *data, size_t count) {
+        auto &matrix = modulation.matrix;
+        auto block = std::clamp<size_t>(matrix.control_block, 1, buffer_size);
+        auto spread = oscillator == Oscillator::SawTooth && sawtooth.spreading();
+        auto wide = [&](size_t at) {
+            return spread ? side.data() + at * max_voices : nullptr;
+        };
+        size_t done = 0;
+        while (done < count) {
+            auto position = from + done;
+            auto step = sequencer.step(position);
+            auto on_step = sequencer.sample_at(step * sequencer.ticks_per_step()) == position;
+            if (on_step) {
+                note_on(sequencer.note(position), sequencer.velocity[step % 8], position);
+            }
+            auto n = std::min<uint64_t>(count - done, sequencer.next_step(position) - position);
+            // the unison saw renders only voices sounding from the start
+            for (size_t v = 0; v < max_voices; v++) {
+                sawtooth.live[v] = envelope.active(v);
+            }
+            envelope.process(amp.data() + done * max_voices, n);
+            if (matrix.count) {
+                for (auto c = done; c < done + n; ) {
+                    auto end = std::min<uint64_t>(done + n, ((from + c) / block + 1) * block - from);
+                    // only where every render would, not where a call
+                    // happens to start, so a seek evaluates as playback did
+                    auto renew = (from + c) % block == 0 || (c == done && on_step) ||
+                        modulation.restarted();
+                    modulate(from + c, c, end - c, renew);
+                    oscillate(lanes.data() + c * max_voices, end - c, wide(c));
+                    c = end;
+                }
+            } else {
+                oscillate(lanes.data() + done * max_voices, n, wide(done));
+            }
+            done += n;
+        }
+        for (size_t i = 0; i < count * max_voices; i++) {
+            lanes[i] *= amp[i];
+        }
+        if (spread) {
+            for (size_t i = 0; i < count * max_voices; i++) {
+                side[i] *= amp[i];
+            }
+        }
+        if (!drive.post_filter) {
+            apply_drive(lanes.data(), wide(0), count);
+        }
+        apply_filter(lanes.data(), wide(0), count, matrix.targets(ModDest::Cutoff) ? cutoff_mod.data() : nullptr);
+        if (drive.post_filter) {
+            apply_drive(lanes.data(), wide(0), count);
+        }
+        eq.process(lanes.data(), count);
+        if (spread) {
+            side_eq.process(side.data(), count);
+        }
+        if (sleep_voices) {
+            doze(lanes.data(), wide(0), count);
+        }
+        if (matrix.targets(ModDest::Pan)) {
+            for (size_t i = 0; i < count; i++) {
+                float left = 0;
+                float right = 0;
+                for (size_t v = 0; v < max_voices; v++) {
+                    auto j = i * max_voices + v;
+                    auto s = spread ? side[j] : 0.0f;
+                    left += (lanes[j] + s) * pan_left[j];
+                    right += (lanes[j] - s) * pan_right[j];
+                }
+                data[i * channels] = left;
+                data[i * channels + 1] = right;
+            }
+        } else if (spread) {
+            for (size_t i = 0; i < count; i++) {
+                float mid = 0;
+                float wide = 0;
+                for (size_t v = 0; v < max_voices; v++) {
+                    mid += lanes[i * max_voices + v];
+                    wide += side[i * max_voices + v];
+                }
+                data[i * channels] = mid + wide;
+                data[i * channels + 1] = mid - wide;
+            }
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                float sum = 0;
+                for (size_t v = 0; v < max_voices; v++) {
+                    sum += lanes[i * max_voices + v];
+                }
+                data[i * channels] = sum;
+                data[i * channels + 1] = sum;
+            }
+        }
+    }
+
+    // samples the filters, effects and drums take to forget what they were
+    // fed, so rendering that long before a point rebuilds their state at it
+    uint64_t settle_length() const {
+        return filter.settle_length() + shaper.memory(drive) + eq.settle_length() + effects.tail_length() +
+            master_eq.settle_length() + dynamics.settle_length() + drums.tail_length();
+    }
+
+    // Moves the clock to target without rendering up to it. The notes that
+    // can still be heard are replayed analytically from their start, then
+    // only the tail the filter still remembers is rendered, so the cost is
+    // independent of target.
+    void fast_forward(uint64_t target) {
+        auto start = target - std::min(settle_length(), target);
+        eq.clear();
+        side_eq.clear();
+        effects.clear();
+        master_eq.clear();
+        dynamics.clear();
+        drums.clear();
+
+        for (size_t v = 0; v < max_voices; v++) {
+            envelope.enter(v, envelope.idle);
+            modulation.restart(v);
+        }
+        held = -1;
+        prime_filter(0);
+
+        auto tps = sequencer.ticks_per_step();
+        auto release = envelope.lengths[envelope.releasing];
+        uint64_t steps[max_voices];
+        size_t count = 0;
+        for (auto step = sequencer.step(start) + 1; step-- > 0 && count < max_voices; ) {
+            if (sequencer.sample_at(step * tps) >= start) {
+                continue;
+            }
+            auto off = sequencer.sample_at((step + 1) * tps);
+            if (off < start && start - off > release) {
+                break;
+            }
+            if (sequencer.pattern[step % 8]) {
+                steps[count++] = step;
+            }
+        }
+        // a modulated pitch, FM feedback or pink noise's filter depend on
+        // more than skip() can follow, so render those notes from their
+        // start instead
+        auto feedback = oscillator == Oscillator::Fm && fm.shape.feedback;
+        auto pink = oscillator == Oscillator::Noise && noise.color == NoiseColor::Pink;
+        if (count && (modulation.matrix.targets(ModDest::Pitch) || feedback || pink)) {
+            start = sequencer.sample_at(steps[count - 1] * tps);
+            count = 0;
+        }
+        uint64_t now = 0;
+        while (count--) {
+            auto begin = sequencer.sample_at(steps[count] * tps);
+            skip_voices(begin - now);
+            now = begin;
+            note_on(sequencer.pattern[steps[count] % 8], sequencer.velocity[steps[count] % 8], begin);
+            auto off = sequencer.sample_at((steps[count] + 1) * tps);
+            if (off < start) {
+                skip_voices(off - now);
+                now = off;
+                note_off();
+            }
+        }
+        skip_voices(start - now);
+
+        // on the same grid of blocks as a render from the start, so notes
+        // rendered from their start are sampled by the modulation alike
+        effects.convolution.realtime = false;
+        for (auto position = start; position < target; ) {
+            auto n = std::min<uint64_t>(target - position, buffer_size - position % buffer_size);
+            render(position, mix.data(), n);
+            position += n;
+        }
+        // so playback that can't wait doesn't start behind the lead-in
+        if (effects.convolution.convolver) {
+            effects.convolution.convolver->drain();
+        }
+
+        t = target;
+        if (!loop.ready()) {
+            loop.restart();
+        }
+    }
+
+    std::mutex patch_mutex;
+    Patch pending_patch;
+    bool patch_pending = false;
+    // the library a patch replaced, dropped by the next load rather than on
+    // the render thread, as dropping the last reference joins its streamer
+    std::shared_ptr<SampleLibrary> retired_samples;
+    // the loop cache's buffer on its way from load to the render thread
+    std::vector<int16_t> pending_loop;
+    bool loop_allocated = false;
+
+    void make_sound(int16_t *data, size_t count) {
+        if (patch_mutex.try_lock()) {
+            if (patch_pending) {
+                envelope.set_shape(pending_patch.amp);
+                modulation.matrix = pending_patch.mod;
+                oscillator = pending_patch.oscillator;
+                fm.set_shape(pending_patch.fm);
+                wavetable.bank = pending_patch.wavetable;
+                wave_position = pending_patch.wave_position;
+                retired_samples = sampler.set_library(pending_patch.samples);
+                sawtooth.set_unison(pending_patch.unison);
+                noise.color = pending_patch.noise;
+                set_drive(pending_patch.drive);
+                eq.set_shape(pending_patch.eq);
+                side_eq.set_shape(pending_patch.eq);
+                effects.set_shape(pending_patch.effects);
+                effects.set_impulse(pending_patch.impulse);
+                master_eq.set_shape(pending_patch.master_eq);
+                dynamics.set_shape(pending_patch.dynamics);
+                drums.set_shape(pending_patch.drums);
+                sawtooth.unmodulate();
+                if (!pending_loop.empty()) {
+                    loop.samples.swap(pending_loop);
+                }
+                patch_pending = false;
+            }
+            patch_mutex.unlock();
+        }
+        auto target = seek_to.exchange(-1);
+        if (target >= 0) {
+            fast_forward(target);
+        }
+        if (auto bpm = bpm_to.exchange(0)) {
+            sequencer.set_bpm(bpm, t);
+        }
+        block_time = t;
+        if (!playing) {
+            std::fill(data, data + count * channels, 0);
+            return;
+        }
+        for (size_t done = 0; done < count; done += buffer_size) {
+            make_block(data + done * channels, std::min(count - done, buffer_size));
+        }
+    }
+
+    void make_block(int16_t *data, size_t count) {
+        auto position = t;
+        auto steady = sawtooth.tuning_v == 1.0f && filter.settled();
+        if (cacheable() && steady && loop.ready() && loop.key == loop_key()) {
+            loop.play(position, data, count);
+            t += count;
+            return;
+        }
+        if (loop.replaying) {
+            fast_forward(position);
+            loop.replaying = false;
+        }
+        t += count;
+        sawtooth.control();
+        filter.control();
+        auto &convolver = effects.convolution.convolver;
+        auto late = convolver ? convolver->late.load() : 0;
+        effects.convolution.realtime = realtime;
+        render(position, mix.data(), count);
+        for (size_t i = 0; i < count * channels; i++) {
+            data[i] = std::clamp(mix[i], -1.0f, 1.0f) * SHRT_MAX;
+        }
+
+        auto length = sequencer.loop_length();
+        if (cacheable() && length <= max_loop_samples) {
+            // a convolution block mixed as silence is heard for the length
+            // of the IR, so the loop is recorded again once that has passed
+            if (convolver && convolver->late != late) {
+                loop.restart();
+            }
+            auto step_start = sequencer.sample_at(sequencer.step(position) * sequencer.ticks_per_step());
+            auto boundary = step_start == position ? 0 : sequencer.next_step(position) - position;
+            // notes last at most a step plus their release, so after that
+            // nothing played before the key took effect can still be heard
+            auto settle = settle_length() + sequencer.step_length() + envelope.lengths[envelope.releasing];
+            loop.update(loop_key(), length, settle, position,
+                        std::min<uint64_t>(boundary, count), data, count);
+        }
+    }
+
+    void play() {
+        playing = true;
+    }
+
+    void stop() {
+        playing = false;
+    }
+
+    void seek(uint64_t sample) {
+        seek_to = sample;
+    }
+
+    void tempo(int bpm) {
+        bpm_to = bpm;
+    }
+
+    void tuning(int a) {
+        sawtooth.tuning_v = 1.0 + 0.01 * a;
+    }
+
+    void cutoff(int a) {
+        filter.cutoff_v = 1.0 + 0.01 * a;
+    }
+
+    void cutoff_hz(float hz) {
+        filter.cutoff = hz;
+    }
+
+    void resonance(float amount) {
+        filter.resonance = amount;
+    }
+
+    void filter_type(FilterType type) {
+        filter.type = type;
+    }
+
+    void load(const Patch &patch) {
+        filter.type = patch.filter;
+        filter.svf_mode = patch.svf_mode;
+        filter.cutoff = patch.cutoff;
+        filter.resonance = patch.resonance;
+        std::shared_ptr<SampleLibrary> retired;
+        std::vector<int16_t> buffer;
+        if (cache_loops && !loop_allocated) {
+            buffer.resize(max_loop_samples * channels);
+            loop_allocated = true;
+        }
+        std::lock_guard lock(patch_mutex);
+        retired = std::move(retired_samples);
+        if (!buffer.empty()) {
+            pending_loop = std::move(buffer);
+        }
+        pending_patch = patch;
+        patch_pending = true;
+    }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Just enough of RIFF WAVE: PCM 16, 24 and 32 bit and float 32, any
+// number of channels, read into interleaved floats.
+struct Wav {
+    uint32_t rate = 0;
+    uint16_t channels = 0;
+    std::vector<float> samples;
+
+    size_t frames() const {
+        return channels ? samples.size() / channels : 0;
+    }
+};
+
+inline bool read_wav(const char *path, Wav &wav) {
+    auto file = fopen(path, "rb");
+    if (!file) {
+        printf("couldn't open %s\n", path);
+        return false;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t chunk[65536];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), file)) > 0; ) {
+        bytes.insert(bytes.end(), chunk, chunk + n);
+    }
+    fclose(file);
+
+    auto u16 = [&](size_t at) { return uint16_t(bytes[at] | bytes[at + 1] << 8); };
+    auto u32 = [&](size_t at) { return uint32_t(u16(at) | uint32_t(u16(at + 2)) << 16); };
+    if (bytes.size() < 12 || memcmp(bytes.data(), "RIFF", 4) || memcmp(bytes.data() + 8, "WAVE", 4)) {
+        printf("%s is not a wav file\n", path);
+        return false;
+    }
+    uint16_t format = 0;
+    uint16_t bits = 0;
+    const uint8_t *data = nullptr;
+    size_t data_size = 0;
+    for (size_t at = 12; at + 8 <= bytes.size(); ) {
+        auto size = std::min<size_t>(u32(at + 4), bytes.size() - at - 8);
+        if (!memcmp(bytes.data() + at, "fmt ", 4) && size >= 16) {
+            format = u16(at + 8);
+            wav.channels = u16(at + 10);
+            wav.rate = u32(at + 12);
+            bits = u16(at + 22);
+            if (format == 0xfffe && size >= 26) {
+                format = u16(at + 32);
+            }
+        } else if (!memcmp(bytes.data() + at, "data", 4)) {
+            data = bytes.data() + at + 8;
+            data_size = size;
+        }
+        at += 8 + size + (size & 1);
+    }
+    auto pcm = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+    auto floats = format == 3 && bits == 32;
+    if (!data || !wav.channels || !wav.rate || !(pcm || floats)) {
+        printf("%s is not 16, 24 or 32 bit pcm or float wav\n", path);
+        return false;
+    }
+    auto width = bits / 8;
+    wav.samples.resize(data_size / width / wav.channels * wav.channels);
+    for (size_t i = 0; i < wav.samples.size(); i++) {
+        auto p = data + i * width;
+        if (floats) {
+            memcpy(&wav.samples[i], p, 4);
+        } else if (bits == 16) {
+            wav.samples[i] = int16_t(p[0] | p[1] << 8) / 32768.0f;
+        } else if (bits == 24) {
+            wav.samples[i] = int32_t(uint32_t(p[0] << 8 | p[1] << 16 | p[2] << 24)) / 2147483648.0f;
+        } else {
+            wav.samples[i] = int32_t(uint32_t(p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24)) / 2147483648.0f;
+        }
+    }
+    return true;
+}
+
+// Writes interleaved 16 bit samples to a file as they are rendered, so a
+// long render needn't be held in memory; finish fills in the sizes in the
+// header written up front.
+struct WavWriter {
+    FILE *file = nullptr;
+    const char *path = nullptr;
+    uint16_t channels = 0;
+    uint32_t rate = 0;
+    uint64_t frames = 0;
+    bool ok = false;
+
+    ~WavWriter() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    bool open(const char *file_path, uint16_t channel_count, uint32_t sample_rate) {
+        path = file_path;
+        channels = channel_count;
+        rate = sample_rate;
+        file = fopen(path, "wb");
+        if (!file) {
+            printf("couldn't create %s\n", path);
+            return false;
+        }
+        ok = header();
+        return ok;
+    }
+
+    // the most a wav can hold, its sizes being 32 bit
+    static uint64_t max_frames(uint16_t channels) {
+        return (UINT32_MAX - 36) / (channels * 2u);
+    }
+
+    bool header() {
+        uint32_t data_size = frames * channels * 2;
+        uint8_t header[44];
+        auto put16 = [&](size_t at, uint16_t v) { header[at] = v; header[at + 1] = v >> 8; };
+        auto put32 = [&](size_t at, uint32_t v) { put16(at, v); put16(at + 2, v >> 16); };
+        memcpy(header, "RIFF", 4);
+        put32(4, 36 + data_size);
+        memcpy(header + 8, "WAVEfmt ", 8);
+        put32(16, 16);
+        put16(20, 1);
+        put16(22, channels);
+        put32(24, rate);
+        put32(28, rate * channels * 2);
+        put16(32, channels * 2);
+        put16(34, 16);
+        memcpy(header + 36, "data", 4);
+        put32(40, data_size);
+        return fwrite(header, sizeof(header), 1, file) == 1;
+    }
+
+    void write(const int16_t *samples, size_t count) {
+        if (ok && frames + count > max_frames(channels)) {
+            printf("%s would pass the 4 GiB a wav can hold\n", path);
+            ok = false;
+        }
+        if (ok && count) {
+            ok = fwrite(samples, channels * 2, count, file) == count;
+        }
+        frames += count;
+    }
+
+    bool finish() {
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && header();
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok) {
+            printf("couldn't write %s\n", path);
+        }
+        return ok;
+    }
+};
+
+// Writes frames of interleaved 16 bit samples.
+inline bool write_wav(const char *path, const int16_t *samples, size_t frames, uint16_t channels, uint32_t rate) {
+    WavWriter writer;
+    if (!writer.open(path, channels, rate)) {
+        return false;
+    }
+    writer.write(samples, frames);
+    return writer.finish();
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A wavetable bank file, native endian:
+//
+//   WavetableHeader                            32 bytes
+//   float samples[table_count][mip_count][table_size + 1]
+//
+// Each table is one cycle; mip m of a table holds only harmonics up to
+// table_size / 2 >> m so it can be played up to that many times higher
+// without aliasing. The extra sample repeats the first for interpolation.
+// Banks are mapped read only and shared, so every process playing the same
+// file uses the same page cache pages and opening costs nothing up front.
+
+constexpr uint32_t wavetable_magic = 0x574e5953; // "SYNW"
+constexpr uint32_t wavetable_version = 1;
+
+struct WavetableHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t table_size;
+    uint32_t table_count;
+    uint32_t mip_count;
+    uint32_t pad[3];
+};
+static_assert(sizeof(WavetableHeader) == 32);
+
+struct WavetableBank {
+    const WavetableHeader *header = nullptr;
+    const float *samples = nullptr;
+    size_t size = 0;
+    uint32_t table_bits = 0;
+
+    static std::shared_ptr<WavetableBank> open(const char *path) {
+        auto fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            printf("couldn't open wavetable bank %s\n", path);
+            return {};
+        }
+        struct stat info;
+        if (fstat(fd, &info) < 0 || size_t(info.st_size) < sizeof(WavetableHeader)) {
+            printf("%s is not a wavetable bank\n", path);
+            close(fd);
+            return {};
+        }
+        auto mem = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            printf("couldn't map wavetable bank %s\n", path);
+            return {};
+        }
+        auto bank = std::make_shared<WavetableBank>();
+        bank->header = static_cast<const WavetableHeader *>(mem);
+        bank->size = info.st_size;
+        auto &h = *bank->header;
+        auto valid = h.magic == wavetable_magic && h.version == wavetable_version &&
+            h.table_size >= 4 && (h.table_size & (h.table_size - 1)) == 0 && h.table_count &&
+            h.mip_count && bank->size == sizeof(WavetableHeader) +
+                size_t(h.table_count) * h.mip_count * (h.table_size + 1) * sizeof(float);
+        if (!valid) {
+            printf("%s is not a wavetable bank\n", path);
+            return {};
+        }
+        bank->samples = reinterpret_cast<const float *>(bank->header + 1);
+        bank->table_bits = std::countr_zero(h.table_size);
+        return bank;
+    }
+
+    const float *table(uint32_t index, uint32_t mip) const {
+        return samples + (size_t(index) * header->mip_count + mip) * (header->table_size + 1);
+    }
+
+    ~WavetableBank() {
+        if (header) {
+            munmap(const_cast<WavetableHeader *>(header), size);
+        }
+    }
+};
+
+// Writes count single cycles of size samples each (a power of two) as a
+// bank, building the mip levels by dropping harmonics from a DFT.
+inline bool write_wavetable_bank(const char *path, const float *cycles, uint32_t count, uint32_t size) {
+    if (size < 4 || (size & (size - 1)) || !count) {
+        printf("wavetables need a power of two size\n");
+        return false;
+    }
+    auto file = fopen(path, "wb");
+    if (!file) {
+        printf("couldn't create wavetable bank %s\n", path);
+        return false;
+    }
+    uint32_t mips = std::countr_zero(size);
+    auto header = WavetableHeader{wavetable_magic, wavetable_version, size, count, mips, {}};
+    auto ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    std::vector<double> cosine(size), sine(size);
+    for (uint32_t i = 0; i < size; i++) {
+        cosine[i] = std::cos(2 * M_PI * i / size);
+        sine[i] = std::sin(2 * M_PI * i / size);
+    }
+    std::vector<double> re(size / 2), im(size / 2);
+    std::vector<float> out(size + 1);
+    for (uint32_t c = 0; c < count && ok; c++) {
+        auto cycle = cycles + size_t(c) * size;
+        for (uint32_t k = 1; k < size / 2; k++) {
+            re[k] = im[k] = 0;
+            for (uint32_t i = 0; i < size; i++) {
+                re[k] += cycle[i] * cosine[size_t(k) * i % size];
+                im[k] += cycle[i] * sine[size_t(k) * i % size];
+            }
+        }
+        for (uint32_t m = 0; m < mips && ok; m++) {
+            auto harmonics = std::max(1u, (size / 2 - 1) >> m);
+            for (uint32_t i = 0; i < size; i++) {
+                double sum = 0;
+                for (uint32_t k = 1; k <= harmonics; k++) {
+                    sum += re[k] * cosine[size_t(k) * i % size] + im[k] * sine[size_t(k) * i % size];
+                }
+                out[i] = sum * 2 / size;
+            }
+            out[size] = out[0];
+            ok = fwrite(out.data(), sizeof(float), out.size(), file) == out.size();
+        }
+    }
+    if (fclose(file) != 0 || !ok) {
+        printf("couldn't write wavetable bank %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// count cycles morphing sine, triangle, saw, square.
+inline std::vector<float> basic_wavetables(uint32_t count, uint32_t size) {
+    std::vector<float> cycles(size_t(count) * size);
+    for (uint32_t c = 0; c < count; c++) {
+        auto at = count > 1 ? 3.0f * c / (count - 1) : 0.0f;
+        auto from = std::min(2, int(at));
+        auto mix = at - from;
+        for (uint32_t i = 0; i < size; i++) {
+            auto phase = float(i) / size;
+            float shapes[4] = {
+                std::sin(2 * float(M_PI) * phase),
+                1.0f - 4.0f * std::abs(phase - 0.5f),
+                phase < 0.5f ? 2 * phase : 2 * phase - 2,
+                phase < 0.5f ? 1.0f : -1.0f,
+            };
+            cycles[size_t(c) * size + i] = shapes[from] + (shapes[from + 1] - shapes[from]) * mix;
+        }
+    }
+    return cycles;
+}
+
+// Wavetable voices for Lanes lanes into [sample * Lanes + lane] blocks.
+// position runs 0 to 1 across the bank's tables and is crossfaded between
+// neighbours; the mip is picked per block from the pitch.
+template <size_t Lanes>
+struct Wavetable {
+    std::shared_ptr<const WavetableBank> bank;
+    uint32_t phase[Lanes] = {};
+    float position[Lanes] = {};
+    float position_step[Lanes] = {};
+
+    void start(size_t lane) {
+        phase[lane] = 0;
+    }
+
+    // speed in half cycles per sample, the SawTooth's units
+    static uint32_t increment(float speed) {
+        return static_cast<uint32_t>(static_cast<int64_t>(speed * 2147483648.0f));
+    }
+
+    void skip(size_t lane, uint64_t n, float speed) {
+        phase[lane] += static_cast<uint32_t>(n * increment(speed));
+    }
+
+    void render(float *lanes, size_t count, float volume, float *speed, const float *accel) {
+        if (!bank) {
+            std::fill(lanes, lanes + count * Lanes, 0.0f);
+            return;
+        }
+        auto &header = *bank->header;
+        auto shift = 32 - bank->table_bits;
+        auto scale = 1.0f / (1u << shift);
+        auto last = header.table_count - 1;
+        for (size_t v = 0; v < Lanes; v++) {
+            auto cycles = std::abs(speed[v] + accel[v] * count) * 0.5f * header.table_size;
+            auto mip = std::min<uint32_t>(header.mip_count - 1,
+                                          std::max(0.0f, std::ceil(std::log2(std::max(cycles, 1.0f)))));
+            auto inc = increment(speed[v]);
+            auto grow = static_cast<int32_t>(accel[v] * 2147483648.0f);
+            auto at = position[v];
+            for (size_t i = 0; i < count; i++) {
+                auto where = std::clamp(at, 0.0f, 1.0f) * last;
+                auto index = std::min<uint32_t>(where, last > 0 ? last - 1 : 0);
+                auto morph = where - index;
+                auto a = bank->table(index, mip);
+                auto b = bank->table(std::min(index + 1, last), mip);
+                auto j = phase[v] >> shift;
+                auto fraction = (phase[v] & ((1u << shift) - 1)) * scale;
+                auto x = a[j] + (a[j + 1] - a[j]) * fraction;
+                auto y = b[j] + (b[j + 1] - b[j]) * fraction;
+                lanes[i * Lanes + v] = (x + (y - x) * morph) * volume;
+                phase[v] += inc;
+                inc += grow;
+                at += position_step[v];
+            }
+            position[v] = at;
+            speed[v] += accel[v] * count;
+        }
+    }
+};